@@ -5,5 +5,11 @@
 #include "../src/phaseCalculator.h"
 #include "../src/stereoProcessor.h"
 #include "../src/speckle.h"
+#include "../src/stereoPipeline.h"
+#include "../src/workspace.h"
+#include "../src/stripProcessor.h"
+#include "../src/stereoBatch.h"
+#include "../src/instrument.h"
+#include "../src/spanMask.h"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <algorithm>
+#include "phaseCalculator.h"
+#include "stereoProcessor.h"
+#include "speckle.h"
+#include "synthetic.h"
+
+using namespace std;
+using namespace cv;
+
+// Window size and search range of speckle matching.
+#define BENCH_SPECKLE_WIN 9
+#define BENCH_SPECKLE_DISPARITY 64
+// Share of left phase pixels replaced by outliers in left-right check case.
+#define BENCH_OUTLIER_RATE 0.01
+
+// Temporary file, removed when it goes out of scope, also by an exception.
+struct tempFile
+{
+    string path;
+    tempFile(const char *suffix) : path(tempfile(suffix)) {}
+    ~tempFile() { remove(path.c_str()); }
+};
+
+// Benchmark options.
+struct benchConfig
+{
+    vector<Size> sizes;
+    vector<int> threads;
+    int repeats;
+    int steps;
+    bool fixed;
+    double noise;
+
+    benchConfig() : repeats(5), steps(4), fixed(false), noise(2.0) {}
+};
+
+// Median time of repeats runs in ms, after one warm-up run.
+static double timeStage(int repeats, const function<void()> &stage)
+{
+    stage();
+    vector<double> ms(repeats);
+    for (int r = 0; r < repeats; ++r)
+    {
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        stage();
+        ms[r] = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+    }
+    sort(ms.begin(), ms.end());
+    return ms[repeats / 2];
+}
+
+static void report(const char *stage, Size size, int threads, double ms, const string &accuracy)
+{
+    double mp = size.area() / 1e6;
+    printf("%-20s %5dx%-5d %3d %10.3f ms %9.2f MP/s  %s\n", stage, size.width, size.height, threads, ms, mp / ms * 1000, accuracy.c_str());
+    fflush(stdout);
+}
+
+// Noise-free fringes over the whole projector, so that every phase combination of the 2-step heterodyne chain is met.
+// Any fringe order error here is an unwrapping defect rather than noise.
+static void benchHeterodyne(const benchConfig &cfg)
+{
+    Size size(4096, 16);
+    syntheticScene scene(size, 0);
+    vector<Mat> fringe1, fringe2;
+    Mat absPhase;
+    scene.makeFringe(cfg.steps, 1, fringe1, fringe2);
+
+    int shift = cfg.steps == 4 ? FOUR_STEP_SHIFT : N_STEP_SHIFT;
+    pmpConfig pmpCfg(scene.freq[0], scene.freq[1], scene.freq[2], 10, shift, TWO_STEP_HETERODYNE, cfg.steps, CV_TYPE);
+    phaseCalculator phaseCal(pmpCfg);
+    double ms = timeStage(cfg.repeats, [&] { phaseCal.calAbsPhaseDirect(fringe1, absPhase); });
+    report("heterodyne sweep", size, omp_get_max_threads(), ms, phaseAccuracy(scene, absPhase));
+}
+
+static void benchSize(const benchConfig &cfg, Size size)
+{
+    syntheticScene scene(size, cfg.noise);
+    vector<Mat> fringe1, fringe2;
+    scene.makeFringe(cfg.steps, 1, fringe1, fringe2);
+    Mat speckle1, speckle2;
+    scene.makeSpeckle(2, speckle1, speckle2);
+
+    int shift = cfg.steps == 4 ? FOUR_STEP_SHIFT : N_STEP_SHIFT;
+    pmpConfig pmpCfg(scene.freq[0], scene.freq[1], scene.freq[2], 10, shift, TWO_STEP_HETERODYNE, cfg.steps, cfg.fixed ? CV_16UC1 : CV_TYPE);
+    phaseCalculator phaseCal(pmpCfg);
+    // Calibration of each resolution goes to a temporary file, so a failed run leaves nothing behind.
+    tempFile cali(".txt");
+    scene.saveCalibration(cali.path);
+    stereoConfig stereoCfg(size, 0, 0.5);
+    stereoCfg.phaseScale = cfg.fixed ? phaseCal.getFixedScale() : 0;
+    stereoCfg.filePath = cali.path;
+    stereoProcessor stereoPro(stereoCfg);
+    stereoCfg.lrCheck = true;
+    stereoProcessor stereoLR(stereoCfg);
+    speckle specklePro(BENCH_SPECKLE_WIN, BENCH_SPECKLE_DISPARITY);
+    speckle speckleSGM(BENCH_SPECKLE_WIN, BENCH_SPECKLE_DISPARITY, 4, 24);
+
+    vector<Mat> freqImg(fringe1.begin(), fringe1.begin() + cfg.steps);
+    vector<Mat> relPhase(3);
+    Mat absPhase1, absPhase2, rectPhase1, rectPhase2, disparity, binary1, binary2, speckleDisparity;
+    Mat outlierPhase, outliers, uncheckedDisparity;
+    pointCloud cloud;
+    for (size_t t = 0; t < cfg.threads.size(); ++t)
+    {
+        int threads = cfg.threads[t];
+        omp_set_num_threads(threads);
+        double ms;
+
+        ms = timeStage(cfg.repeats, [&] { phaseCal.calRelPhase(freqImg, relPhase[0]); });
+        report("calRelPhase", size, threads, ms, "");
+        for (int f = 1; f < 3; ++f)
+            phaseCal.calRelPhase(vector<Mat>(fringe1.begin() + f * cfg.steps, fringe1.begin() + (f + 1) * cfg.steps), relPhase[f]);
+        ms = timeStage(cfg.repeats, [&] { phaseCal.calAbsPhase(relPhase, absPhase1); });
+        report("calAbsPhase", size, threads, ms, phaseAccuracy(scene, absPhase1, phaseCal.getFixedScale()));
+        ms = timeStage(cfg.repeats, [&] { phaseCal.calAbsPhaseDirect(fringe1, absPhase1); });
+        report("calAbsPhaseDirect", size, threads, ms, phaseAccuracy(scene, absPhase1, phaseCal.getFixedScale()));
+        phaseCal.calAbsPhaseDirect(fringe2, absPhase2);
+
+        ms = timeStage(cfg.repeats, [&] { stereoPro.rectifyPhase(absPhase1, absPhase2, rectPhase1, rectPhase2); });
+        report("rectifyPhase", size, threads, ms, "");
+        ms = timeStage(cfg.repeats, [&] { stereoPro.calDisparity(rectPhase1, rectPhase2, disparity); });
+        report("calDisparity", size, threads, ms, disparityAccuracy(scene, disparity));
+        ms = timeStage(cfg.repeats, [&] { stereoPro.calDisparityRectify(absPhase1, absPhase2, disparity); });
+        report("calDisparityRectify", size, threads, ms, disparityAccuracy(scene, disparity));
+        ms = timeStage(cfg.repeats, [&] { cloud.clear(); stereoPro.calDisparity(rectPhase1, rectPhase2, disparity, cloud); });
+        report("calDisparity+cloud", size, threads, ms, cloudAccuracy(scene, cloud));
+        ms = timeStage(cfg.repeats, [&] { stereoLR.calDisparity(rectPhase1, rectPhase2, disparity); });
+        report("calDisparity lrCheck", size, threads, ms, disparityAccuracy(scene, disparity));
+
+        // Left phase outliers, matched without and with left-right check.
+        outlierPhase = rectPhase1.clone();
+        injectOutliers(3, BENCH_OUTLIER_RATE, outlierPhase, outliers);
+        ms = timeStage(cfg.repeats, [&] { stereoPro.calDisparity(outlierPhase, rectPhase2, uncheckedDisparity); });
+        report("outliers", size, threads, ms, outlierAccuracy(scene, uncheckedDisparity, outliers));
+        ms = timeStage(cfg.repeats, [&] { stereoLR.calDisparity(outlierPhase, rectPhase2, disparity); });
+        report("outliers lrCheck", size, threads, ms, outlierAccuracy(scene, disparity, outliers, uncheckedDisparity));
+
+        ms = timeStage(cfg.repeats, [&] { specklePro.DB(speckle1, binary1); });
+        report("speckle::DB", size, threads, ms, "");
+        specklePro.DB(speckle2, binary2);
+        int margin = BENCH_SPECKLE_WIN / 2;
+        ms = timeStage(cfg.repeats, [&] { specklePro.match(binary1, binary2, speckleDisparity); });
+        report("speckle::match", size, threads, ms, speckleAccuracy(scene, speckleDisparity, margin));
+        ms = timeStage(cfg.repeats, [&] { speckleSGM.match(binary1, binary2, speckleDisparity); });
+        report("speckle::match SGM", size, threads, ms, speckleAccuracy(scene, speckleDisparity, margin));
+    }
+}
+
+static void usage()
+{
+    cout << "Usage: pmpBench [-s WxH]... [-t threads]... [-r repeats] [-n steps] [-e noise] [-x]" << endl;
+    cout << "  -s  Image size, repeatable. Default 640x480, 1280x1024 and 2448x2048." << endl;
+    cout << "  -t  OpenMP threads, repeatable. Default 1 and all cores." << endl;
+    cout << "  -r  Timed runs per stage, the median is reported. Default 5." << endl;
+    cout << "  -n  Phase shift steps, 4 or N >= 3 for N-step algorithm. Default 4." << endl;
+    cout << "  -e  Standard deviation of gray level noise. Default 2." << endl;
+    cout << "  -x  16-bit fixed-point absolute phase." << endl;
+}
+
+int main(int argc, char **argv)
+{
+    benchConfig cfg;
+    for (int k = 1; k < argc; ++k)
+    {
+        bool hasValue = k + 1 < argc;
+        if (!strcmp(argv[k], "-s") && hasValue)
+        {
+            int w, h;
+            if (sscanf(argv[++k], "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0)
+            {
+                usage();
+                return 1;
+            }
+            cfg.sizes.push_back(Size(w, h));
+        }
+        else if (!strcmp(argv[k], "-t") && hasValue)
+            cfg.threads.push_back(max(atoi(argv[++k]), 1));
+        else if (!strcmp(argv[k], "-r") && hasValue)
+            cfg.repeats = max(atoi(argv[++k]), 1);
+        else if (!strcmp(argv[k], "-n") && hasValue)
+            cfg.steps = max(atoi(argv[++k]), 3);
+        else if (!strcmp(argv[k], "-e") && hasValue)
+            cfg.noise = max(atof(argv[++k]), 0.0);
+        else if (!strcmp(argv[k], "-x"))
+            cfg.fixed = true;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (cfg.sizes.empty())
+    {
+        cfg.sizes.push_back(Size(640, 480));
+        cfg.sizes.push_back(Size(1280, 1024));
+        cfg.sizes.push_back(Size(2448, 2048));
+    }
+    if (cfg.threads.empty())
+    {
+        cfg.threads.push_back(1);
+        if (omp_get_num_procs() > 1)
+            cfg.threads.push_back(omp_get_num_procs());
+    }
+
+    printf("%-20s %11s %3s %13s %14s  %s\n", "stage", "size", "thr", "time", "throughput", "accuracy");
+    benchHeterodyne(cfg);
+    for (size_t k = 0; k < cfg.sizes.size(); ++k)
+        benchSize(cfg, cfg.sizes[k]);
+    return 0;
+}
@@ -0,0 +1,293 @@
+#include "synthetic.h"
+#include "phaseFixed.h"
+#include <cmath>
+#include <random>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+using namespace cv;
+
+// Mean gray level and fringe amplitude.
+#define FRINGE_MEAN 128.0
+#define FRINGE_AMPLITUDE 100.0
+// Pixels per lattice cell of speckle pattern.
+#define SPECKLE_CELL 2
+// Min columns between an outlier and the pixel its phase is taken from.
+#define OUTLIER_SHIFT 10
+
+syntheticScene::syntheticScene(Size img_size, double noise) : imgSize(img_size),
+                                                              noise(noise)
+{
+    // Disparity from 20 to about 40 pixels at any resolution, within the default search range of speckle.
+    d0 = 20;
+    dx = 15.0 / img_size.width;
+    dy = 5.0 / img_size.height;
+    focal = img_size.width;
+    baseline = 100;
+    // 2-step heterodyne. freq1 - freq2 beats freq3 to one period over the projector.
+    freq[0] = 70;
+    freq[1] = 64;
+    freq[2] = 5;
+}
+
+double syntheticScene::disparity(double x, double y) const
+{
+    return d0 + dx * x + dy * y;
+}
+
+double syntheticScene::leftColumn(double x2, double y, int sign) const
+{
+    // Solve x2 = x + sign * disparity(x, y) for x.
+    return (x2 - sign * (d0 + dy * y)) / (1 + sign * dx);
+}
+
+double syntheticScene::projector(double x) const
+{
+    return 0.02 + 0.96 * (x + 0.5) / imgSize.width;
+}
+
+double syntheticScene::depth(double X, double Y) const
+{
+    // Plane of disparity(x, y) = focal * baseline / Z, with x = focal * X / Z + cx and y = focal * Y / Z + cy.
+    double cx = (imgSize.width - 1) / 2.0, cy = (imgSize.height - 1) / 2.0;
+    return (focal * baseline - dx * focal * X - dy * focal * Y) / (d0 + dx * cx + dy * cy);
+}
+
+void syntheticScene::saveCalibration(const string &filePath) const
+{
+    ofstream file(filePath, ios::out);
+    if (file.fail())
+    {
+        cout << "Can't open calibration file!" << endl;
+        throw exception();
+    }
+
+    double cx = (imgSize.width - 1) / 2.0, cy = (imgSize.height - 1) / 2.0;
+    file.precision(17);
+    // K1, D1, K2 and D2. Identical distortion-free cameras.
+    for (int c = 0; c < 2; ++c)
+    {
+        file << focal << " 0 " << cx << " 0 " << focal << " " << cy << " 0 0 1\n";
+        file << "0 0 0 0 0\n";
+    }
+    // R and T. Camera 2 is moved along x by baseline.
+    file << "1 0 0 0 1 0 0 0 1\n";
+    file << -baseline << " 0 0\n";
+    // F and E.
+    file << "0 0 0 0 0 " << baseline / focal << " 0 " << -baseline / focal << " 0\n";
+    file << "0 0 0 0 0 " << baseline << " 0 " << -baseline << " 0\n";
+    file.close();
+}
+
+void syntheticScene::makeFringe(int steps, unsigned seed, vector<Mat> &img1, vector<Mat> &img2) const
+{
+    mt19937 gen(seed);
+    normal_distribution<double> gauss(0, noise);
+    img1.resize(3 * steps);
+    img2.resize(3 * steps);
+    for (int f = 0; f < 3; ++f)
+        for (int n = 0; n < steps; ++n)
+        {
+            Mat &I1 = img1[f * steps + n], &I2 = img2[f * steps + n];
+            I1.create(imgSize, CV_8UC1);
+            I2.create(imgSize, CV_8UC1);
+            double shift = PI_2 * n / steps;
+            for (int i = 0; i < imgSize.height; ++i)
+                for (int j = 0; j < imgSize.width; ++j)
+                    for (int c = 0; c < 2; ++c)
+                    {
+                        double u = projector(c ? leftColumn(j, i, -1) : j);
+                        // No fringe out of projector.
+                        double v = FRINGE_MEAN + gauss(gen);
+                        if (u >= 0 && u < 1)
+                            v += FRINGE_AMPLITUDE * cos(PI_2 * freq[f] * u + shift);
+                        (c ? I2 : I1).at<uchar>(i, j) = saturate_cast<uchar>(v);
+                    }
+        }
+}
+
+void syntheticScene::makeSpeckle(unsigned seed, Mat &img1, Mat &img2) const
+{
+    mt19937 gen(seed);
+    normal_distribution<double> gauss(0, noise);
+    // Random lattice, bilinear between cells. Columns wrap so that the right image is defined everywhere.
+    int latticeCols = imgSize.width / SPECKLE_CELL + 2, latticeRows = imgSize.height / SPECKLE_CELL + 2;
+    vector<uchar> lattice((size_t)latticeCols * latticeRows);
+    for (size_t k = 0; k < lattice.size(); ++k)
+        lattice[k] = gen() & 0xFF;
+
+    img1.create(imgSize, CV_8UC1);
+    img2.create(imgSize, CV_8UC1);
+    for (int i = 0; i < imgSize.height; ++i)
+    {
+        double v = (double)i / SPECKLE_CELL;
+        int r = (int)v;
+        double fv = v - r;
+        for (int j = 0; j < imgSize.width; ++j)
+            for (int c = 0; c < 2; ++c)
+            {
+                double u = (c ? leftColumn(j, i, 1) : j) / SPECKLE_CELL;
+                int q = (int)floor(u);
+                double fu = u - q;
+                q = ((q % latticeCols) + latticeCols) % latticeCols;
+                int q1 = (q + 1) % latticeCols;
+                const uchar *l0 = &lattice[(size_t)r * latticeCols], *l1 = l0 + latticeCols;
+                double s = (1 - fv) * ((1 - fu) * l0[q] + fu * l0[q1]) + fv * ((1 - fu) * l1[q] + fu * l1[q1]);
+                (c ? img2 : img1).at<uchar>(i, j) = saturate_cast<uchar>(s + gauss(gen));
+            }
+    }
+}
+
+string phaseAccuracy(const syntheticScene &scene, const Mat &absPhase, double scale)
+{
+    long total = 0, valid = 0, order = 0;
+    double sum2 = 0;
+    vector<TYPE> row(absPhase.cols);
+    for (int i = 0; i < absPhase.rows; ++i)
+    {
+        if (absPhase.type() == CV_16UC1)
+            decodePhaseRow(absPhase.ptr<ushort>(i), &row[0], absPhase.cols, (TYPE)scale);
+        for (int j = 0; j < absPhase.cols; ++j)
+        {
+            double u = scene.projector(j);
+            if (u < 0 || u >= 1)
+                continue;
+            ++total;
+            double v = absPhase.type() == CV_16UC1 ? row[j] : absPhase.depth() == CV_64F ? absPhase.at<double>(i, j) : absPhase.at<float>(i, j);
+            if (std::isnan(v))
+                continue;
+            ++valid;
+            double e = v - PI_2 * scene.freq[0] * u;
+            // Error over half a period is a wrong fringe order.
+            if (fabs(e) > PI_2 / 2)
+                ++order;
+            else
+                sum2 += e * e;
+        }
+    }
+    char buf[128];
+    snprintf(buf, sizeof(buf), "valid %.2f%% rms %.4f rad order errors %.3f%%", 100.0 * valid / max(total, 1L),
+             sqrt(sum2 / max(valid - order, 1L)), 100.0 * order / max(valid, 1L));
+    return buf;
+}
+
+string disparityAccuracy(const syntheticScene &scene, const Mat &disparity)
+{
+    long total = 0, valid = 0, bad = 0;
+    double sum = 0, sum2 = 0;
+    for (int i = 0; i < disparity.rows; ++i)
+        for (int j = 0; j < disparity.cols; ++j)
+        {
+            double d = scene.disparity(j, i), u = scene.projector(j);
+            if (j - d < 0 || j - d > disparity.cols - 1 || u < 0 || u >= 1)
+                continue;
+            ++total;
+            double v = disparity.at<TYPE>(i, j);
+            if (!(v > 0))
+                continue;
+            ++valid;
+            double e = fabs(v - d);
+            sum += e;
+            sum2 += e * e;
+            if (e > 1)
+                ++bad;
+        }
+    char buf[128];
+    snprintf(buf, sizeof(buf), "valid %.2f%% mae %.4f px rms %.4f px bad %.3f%%", 100.0 * valid / max(total, 1L),
+             sum / max(valid, 1L), sqrt(sum2 / max(valid, 1L)), 100.0 * bad / max(valid, 1L));
+    return buf;
+}
+
+string cloudAccuracy(const syntheticScene &scene, const pointCloud &cloud)
+{
+    double sum2 = 0;
+    for (size_t k = 0; k < cloud.size(); ++k)
+    {
+        double e = cloud.z[k] - scene.depth(cloud.x[k], cloud.y[k]);
+        sum2 += e * e;
+    }
+    char buf[128];
+    snprintf(buf, sizeof(buf), "points %zu z rms %.4f mm", cloud.size(), sqrt(sum2 / max(cloud.size(), (size_t)1)));
+    return buf;
+}
+
+void injectOutliers(unsigned seed, double rate, Mat &phase, Mat &outliers)
+{
+    mt19937 gen(seed);
+    uniform_real_distribution<double> uniform(0, 1);
+    outliers = Mat::zeros(phase.size(), CV_8U);
+    size_t elem = phase.elemSize();
+    for (int i = 0; i < phase.rows; ++i)
+        for (int j = 0; j < phase.cols; ++j)
+        {
+            if (uniform(gen) >= rate)
+                continue;
+            int src = (j + OUTLIER_SHIFT + gen() % max(phase.cols - 2 * OUTLIER_SHIFT, 1)) % phase.cols;
+            memcpy(phase.ptr(i) + j * elem, phase.ptr(i) + src * elem, elem);
+            outliers.at<uchar>(i, j) = 1;
+        }
+}
+
+// Count false matches of outliers, and outliers and valid other pixels, over pixels whose match is inside the right image.
+static void countOutliers(const syntheticScene &scene, const Mat &disparity, const Mat &outliers, long &outlierNum, long &falseNum, long &inlierNum, long &validNum)
+{
+    outlierNum = falseNum = inlierNum = validNum = 0;
+    for (int i = 0; i < disparity.rows; ++i)
+        for (int j = 0; j < disparity.cols; ++j)
+        {
+            double d = scene.disparity(j, i), u = scene.projector(j);
+            if (j - d < 0 || j - d > disparity.cols - 1 || u < 0 || u >= 1)
+                continue;
+            double v = disparity.at<TYPE>(i, j);
+            if (outliers.at<uchar>(i, j))
+            {
+                ++outlierNum;
+                falseNum += (v > 0 && fabs(v - d) > 1) ? 1 : 0;
+            }
+            else
+            {
+                ++inlierNum;
+                validNum += (v > 0) ? 1 : 0;
+            }
+        }
+}
+
+string outlierAccuracy(const syntheticScene &scene, const Mat &disparity, const Mat &outliers, const Mat &unchecked)
+{
+    long outlierNum, falseNum, inlierNum, validNum;
+    countOutliers(scene, disparity, outliers, outlierNum, falseNum, inlierNum, validNum);
+    char buf[160];
+    int n = snprintf(buf, sizeof(buf), "outliers %ld false match %.2f%% inliers valid %.2f%%", outlierNum,
+                     100.0 * falseNum / max(outlierNum, 1L), 100.0 * validNum / max(inlierNum, 1L));
+    if (!unchecked.empty())
+    {
+        long uncheckedFalse, unused[3];
+        countOutliers(scene, unchecked, outliers, unused[0], uncheckedFalse, unused[1], unused[2]);
+        snprintf(buf + n, sizeof(buf) - n, " rejected %.2f%%", 100.0 * (uncheckedFalse - falseNum) / max(uncheckedFalse, 1L));
+    }
+    return buf;
+}
+
+string speckleAccuracy(const syntheticScene &scene, const Mat &disparity, int margin)
+{
+    long total = 0, good = 0;
+    double sum = 0;
+    for (int i = margin; i < disparity.rows - margin; ++i)
+        for (int j = margin; j < disparity.cols - margin; ++j)
+        {
+            double d = scene.disparity(j, i);
+            if (j + d > disparity.cols - 1 - margin)
+                continue;
+            ++total;
+            double e = fabs(disparity.at<ushort>(i, j) - d);
+            sum += e;
+            if (e <= 1)
+                ++good;
+        }
+    char buf[128];
+    snprintf(buf, sizeof(buf), "within 1 px %.2f%% mae %.3f px", 100.0 * good / max(total, 1L), sum / max(total, 1L));
+    return buf;
+}
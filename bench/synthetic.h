@@ -0,0 +1,58 @@
+#ifndef SYNTHETIC
+#define SYNTHETIC
+
+#include <string>
+#include <vector>
+#include "setting.h"
+#include "pointCloud.h"
+
+// Synthetic scene of the benchmark. A tilted plane seen by an ideal rectified camera pair.
+// Ground truth disparity of left pixel (x, y) is d0 + dx * x + dy * y.
+// Fringe pairs follow stereoProcessor, the right pixel is x - disparity.
+// Speckle pairs follow speckle::match, the right pixel is x + disparity.
+struct syntheticScene
+{
+    cv::Size imgSize;
+    double d0, dx, dy;
+    // Focal length in pixels and baseline in mm.
+    double focal, baseline;
+    // Frequencies of fringe patterns, for TWO_STEP_HETERODYNE.
+    double freq[3];
+    // Standard deviation of gray level noise.
+    double noise;
+
+    syntheticScene(cv::Size img_size, double noise = 2.0);
+
+    // Ground truth disparity of left pixel.
+    double disparity(double x, double y) const;
+    // Left column seen by right pixel (x2, y). sign is -1 for fringe pairs and 1 for speckle pairs.
+    double leftColumn(double x2, double y, int sign) const;
+    // Projector coordinate in [0, 1) seen by left column x. Out of [0, 1) where the projector does not reach.
+    double projector(double x) const;
+    // Ground truth depth of the plane at X and Y of rectified camera 1.
+    double depth(double X, double Y) const;
+
+    // Write calibration result of the pair in the format of stereoProcessor::loadCaliResult.
+    void saveCalibration(const std::string &filePath) const;
+    // N-step fringe images of both cameras. freq1, freq2 and freq3 in order, steps images each.
+    void makeFringe(int steps, unsigned seed, std::vector<cv::Mat> &img1, std::vector<cv::Mat> &img2) const;
+    // Random speckle images of both cameras.
+    void makeSpeckle(unsigned seed, cv::Mat &img1, cv::Mat &img2) const;
+};
+
+// Accuracy of absolute phase of left camera against ground truth. scale is the fixed-point scale of CV_16UC1 maps.
+std::string phaseAccuracy(const syntheticScene &scene, const cv::Mat &absPhase, double scale = 0);
+// Accuracy of phase disparity, over pixels whose match is inside the right image.
+std::string disparityAccuracy(const syntheticScene &scene, const cv::Mat &disparity);
+// Depth error of points against the plane.
+std::string cloudAccuracy(const syntheticScene &scene, const pointCloud &cloud);
+// Replace about rate of left phase pixels by the phase of another column of the same row, a wrong but plausible value.
+// outliers is CV_8U, 1 at replaced pixels. phase is CV_TYPE or CV_16UC1.
+void injectOutliers(unsigned seed, double rate, cv::Mat &phase, cv::Mat &outliers);
+// False matches of outlier pixels and valid share of other pixels. With the disparity of an unchecked match,
+// also the share of its false matches rejected.
+std::string outlierAccuracy(const syntheticScene &scene, const cv::Mat &disparity, const cv::Mat &outliers, const cv::Mat &unchecked = cv::Mat());
+// Accuracy of CV_16U speckle disparity. margin columns and rows at borders are skipped.
+std::string speckleAccuracy(const syntheticScene &scene, const cv::Mat &disparity, int margin);
+
+#endif
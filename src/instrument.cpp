@@ -0,0 +1,150 @@
+#include "instrument.h"
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+pmpStats::pmpStats()
+{
+    clear();
+}
+
+void pmpStats::clear()
+{
+    frameId = 0;
+    frameMs = 0;
+    memset(stageMs, 0, sizeof(stageMs));
+    memset(counts, 0, sizeof(counts));
+    threads = 0;
+    threadMs.clear();
+    threadRows.clear();
+}
+
+pmpInstrument::pmpInstrument(function<void(const pmpStats &)> callback) : callback(callback),
+                                                                         callDepth(0)
+{
+    beginFrame(0);
+}
+
+bool pmpInstrument::enabled()
+{
+#ifdef PMP_INSTRUMENTATION
+    return true;
+#else
+    return false;
+#endif
+}
+
+pmpInstrument::threadSlot *pmpInstrument::slot()
+{
+    size_t t = omp_get_thread_num();
+    return t < slots.size() ? &slots[t] : NULL;
+}
+
+void pmpInstrument::busyTime(double *ms) const
+{
+    for (int s = 0; s < STAGE_NUM; ++s)
+        ms[s] = 0;
+    for (size_t t = 0; t < slots.size(); ++t)
+        for (int s = 0; s < STAGE_NUM; ++s)
+            ms[s] += slots[t].ms[s];
+}
+
+void pmpInstrument::beginFrame(int id)
+{
+    // Thread number may have been raised since the last frame.
+    slots.resize(max(omp_get_max_threads(), omp_get_num_procs()));
+    memset(&slots[0], 0, slots.size() * sizeof(threadSlot));
+    current.clear();
+    current.frameId = id;
+    callDepth = 0;
+    frameBegin = clock::now();
+}
+
+void pmpInstrument::endFrame()
+{
+    current.frameMs = chrono::duration<double, milli>(clock::now() - frameBegin).count();
+    // Threads that never recorded are trimmed.
+    int threads = 0;
+    for (size_t t = 0; t < slots.size(); ++t)
+        for (int s = 0; s < STAGE_NUM; ++s)
+            if (slots[t].rows[s])
+                threads = t + 1;
+    current.threads = threads;
+    current.threadMs.resize(threads * STAGE_NUM);
+    current.threadRows.resize(threads * STAGE_NUM);
+    for (int t = 0; t < threads; ++t)
+        for (int s = 0; s < STAGE_NUM; ++s)
+        {
+            current.threadMs[t * STAGE_NUM + s] = slots[t].ms[s];
+            current.threadRows[t * STAGE_NUM + s] = slots[t].rows[s];
+        }
+    for (size_t t = 0; t < slots.size(); ++t)
+        for (int c = 0; c < COUNT_NUM; ++c)
+            current.counts[c] += slots[t].counts[c];
+
+    if (callback)
+        callback(current);
+}
+
+const pmpStats &pmpInstrument::stats() const
+{
+    return current;
+}
+
+void pmpInstrument::addBusy(int stage, double ms, long rows)
+{
+    threadSlot *s = slot();
+    if (s)
+    {
+        s->ms[stage] += ms;
+        s->rows[stage] += rows;
+    }
+}
+
+void pmpInstrument::count(int counter, long n)
+{
+    threadSlot *s = slot();
+    if (s)
+        s->counts[counter] += n;
+}
+
+bool pmpInstrument::enterCall()
+{
+    lock_guard<mutex> lock(callMtx);
+    if (callDepth && caller != this_thread::get_id())
+    {
+        cout << "Instrument is used by two threads at once!" << endl;
+        throw exception();
+    }
+    caller = this_thread::get_id();
+    return !callDepth++;
+}
+
+bool pmpInstrument::leaveCall()
+{
+    lock_guard<mutex> lock(callMtx);
+    return !--callDepth;
+}
+
+pmpInstrument::callTimer::callTimer(pmpInstrument *ins) : ins(ins)
+{
+    if (!ins || !ins->enterCall())
+        return;
+    ins->busyTime(busy);
+    begin = clock::now();
+}
+
+pmpInstrument::callTimer::~callTimer()
+{
+    if (!ins || !ins->leaveCall())
+        return;
+    double wall = chrono::duration<double, milli>(clock::now() - begin).count();
+    double now[STAGE_NUM], total = 0;
+    ins->busyTime(now);
+    for (int s = 0; s < STAGE_NUM; ++s)
+        total += now[s] - busy[s];
+    if (total > 0)
+        for (int s = 0; s < STAGE_NUM; ++s)
+            ins->current.stageMs[s] += wall * (now[s] - busy[s]) / total;
+}
@@ -0,0 +1,172 @@
+#ifndef PMP_INSTRUMENT
+#define PMP_INSTRUMENT
+
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include "setting.h"
+
+// Stages of a frame.
+#define STAGE_WRAP 0      // Relative phase.
+#define STAGE_UNWRAP 1    // Heterodyne unwrapping.
+#define STAGE_FILTER 2    // Phase filter.
+#define STAGE_RECTIFY 3   // Remap of phase maps.
+#define STAGE_MATCH 4     // Phase matching.
+#define STAGE_REPROJECT 5 // Reprojection to points.
+#define STAGE_SPECKLE 6   // Speckle binarization and matching.
+#define STAGE_NUM 7
+// Counters of a frame.
+#define COUNT_PHASE_PIXELS 0       // Relative phase pixels calculated, all frequencies.
+#define COUNT_LOW_MODULATION 1     // Relative phase pixels rejected by BTH.
+#define COUNT_ABS_VALID 2          // Valid absolute phase pixels.
+#define COUNT_MATCH_OUT_ROI 3      // Left pixels out of ROI1.
+#define COUNT_MATCH_INVALID 4      // Left pixels of invalid phase.
+#define COUNT_MATCH_NO_MATCH 5     // Left pixels without right phase within matchTH.
+#define COUNT_MATCH_DISPARITY_TH 6 // Matches under disparityTH.
+#define COUNT_MATCH_VALID 7        // Valid disparities.
+#define COUNT_MATCH_LR_FAIL 8      // Matches rejected by left-right check.
+#define COUNT_POINTS 9             // Reprojected points.
+#define COUNT_ORDER_FIXED 10       // Absolute phase pixels of fringe order fixed by phase filter.
+#define COUNT_NUM 11
+
+// Statistics of one frame.
+struct pmpStats
+{
+    int frameId;
+    // Wall time from beginFrame to endFrame.
+    double frameMs;
+    // Wall time of each stage. Time of calls fusing stages is split by busy time of the stages.
+    double stageMs[STAGE_NUM];
+    long counts[COUNT_NUM];
+    int threads;
+    // Busy time and rows of thread t in stage s at [t * STAGE_NUM + s].
+    std::vector<double> threadMs;
+    std::vector<long> threadRows;
+
+    pmpStats();
+    void clear();
+};
+
+// Per-stage timers and counters of frames, forwarded to a callback at the end of each frame.
+// Hooks are compiled in with PMP_INSTRUMENTATION only, otherwise stats stay zero and cost nothing.
+// An instrument records one frame at a time. Slots are per OpenMP thread number, so objects running concurrently,
+// e.g. stages of stereoPipeline, need one each. Public calls from two threads at once throw.
+class pmpInstrument
+{
+protected:
+    typedef std::chrono::steady_clock clock;
+
+    // Record of a thread. Padding keeps records of neighbouring threads off shared cache lines.
+    struct threadSlot
+    {
+        double ms[STAGE_NUM];
+        long rows[STAGE_NUM];
+        long counts[COUNT_NUM];
+        char pad[64];
+    };
+
+    std::function<void(const pmpStats &)> callback;
+    std::vector<threadSlot> slots;
+    pmpStats current;
+    clock::time_point frameBegin;
+    // Depth of nested public calls. Only the outermost call splits its wall time.
+    int callDepth;
+    // Thread of the running public call.
+    std::thread::id caller;
+    std::mutex callMtx;
+
+    // Slot of calling thread, NULL if the team is larger than the slots.
+    threadSlot *slot();
+    // Busy time of all threads in each stage.
+    void busyTime(double *ms) const;
+    // Enter and leave a public call. Return true for the outermost call.
+    bool enterCall();
+    bool leaveCall();
+
+public:
+    // Wall time of a public call, split to stages by the busy time they add.
+    class callTimer
+    {
+    protected:
+        pmpInstrument *ins;
+        clock::time_point begin;
+        double busy[STAGE_NUM];
+
+    public:
+        callTimer(pmpInstrument *ins);
+        ~callTimer();
+    };
+    // Busy time and rows of calling thread in a stage.
+    class rowTimer
+    {
+    protected:
+        pmpInstrument *ins;
+        int stage;
+        long rows;
+        clock::time_point begin;
+
+    public:
+        rowTimer(pmpInstrument *ins, int stage, long rows) : ins(ins), stage(stage), rows(rows)
+        {
+            if (ins)
+                begin = clock::now();
+        }
+        ~rowTimer()
+        {
+            if (ins)
+                ins->addBusy(stage, std::chrono::duration<double, std::milli>(clock::now() - begin).count(), rows);
+        }
+    };
+
+    pmpInstrument(std::function<void(const pmpStats &)> callback = nullptr);
+    // True if hooks are compiled in.
+    static bool enabled();
+
+    // Start a frame and clear stats. Call outside parallel regions.
+    void beginFrame(int id);
+    // Finish the frame, fill stats and call back. Call outside parallel regions.
+    void endFrame();
+    // Stats of the last finished frame.
+    const pmpStats &stats() const;
+
+    void addBusy(int stage, double ms, long rows);
+    void count(int counter, long n);
+};
+
+// Invalid values of a row.
+template <typename T>
+inline long countNaN(const T *row, int cols)
+{
+    long n = 0;
+    for (int j = 0; j < cols; ++j)
+        n += row[j] != row[j];
+    return n;
+}
+
+#ifdef PMP_INSTRUMENTATION
+// Split wall time of a public call to stages. Place at the top of the call.
+#define PMP_CALL(ins) pmpInstrument::callTimer pmpCallTimer_(ins)
+// Record busy time and rows of calling thread in stage until the end of the scope.
+#define PMP_ROWS(ins, stage, rows) pmpInstrument::rowTimer pmpRowTimer_##stage(ins, stage, rows)
+// Add n to counter. n is not evaluated without instrument.
+#define PMP_COUNT(ins, counter, n)    \
+    do                                \
+    {                                 \
+        if (ins)                      \
+            (ins)->count(counter, n); \
+    } while (0)
+#else
+// Arguments are consumed, so that instrument parameters and counts do not warn as unused. n is still not evaluated.
+#define PMP_CALL(ins) (void)(ins)
+#define PMP_ROWS(ins, stage, rows) (void)(ins)
+#define PMP_COUNT(ins, counter, n) \
+    do                             \
+    {                              \
+        (void)(ins);               \
+        (void)sizeof(n);           \
+    } while (0)
+#endif
+
+#endif
@@ -1,18 +1,44 @@
 #include "phaseCalculator.h"
+#include "phaseKernels.h"
 
 using namespace std;
 using namespace cv;
 
-pmpConfig::pmpConfig(TYPE freq1, TYPE freq2, TYPE freq3, TYPE B_th, bool shiftSteps, bool heterodyneSteps) : freq1(freq1),
-                                                                                                             freq2(freq2),
-                                                                                                             freq3(freq3),
-                                                                                                             BTH(B_th),
-                                                                                                             shiftSteps(shiftSteps),
-                                                                                                             heterodyneSteps(heterodyneSteps)
+pmpConfig::pmpConfig(TYPE freq1, TYPE freq2, TYPE freq3, TYPE B_th, int shiftSteps, bool heterodyneSteps, int stepNum, int phaseType) : freq1(freq1),
+                                                                                                                            freq2(freq2),
+                                                                                                                            freq3(freq3),
+                                                                                                                            BTH(B_th),
+                                                                                                                            shiftSteps(shiftSteps),
+                                                                                                                            heterodyneSteps(heterodyneSteps),
+                                                                                                                            stepNum(stepNum),
+                                                                                                                            phaseType(phaseType),
+                                                                                                                            unwrapMethod(HETERODYNE_UNWRAP),
+                                                                                                                            unwrapTH(0.5),
+                                                                                                                            filterSize(PHASE_FILTER_WINSIZE)
 {
 }
 
-phaseCalculator::phaseCalculator(const pmpConfig &cfg)
+pmpConfig::pmpConfig(const vector<TYPE> &freqs, TYPE B_th, int shiftSteps, int unwrapMethod, int stepNum, int phaseType, TYPE unwrapTH) : freq1(freqs.empty() ? 0 : freqs[0]),
+                                                                                                                                 freq2(freqs.size() > 1 ? freqs[1] : 0),
+                                                                                                                                 freq3(freqs.size() > 2 ? freqs[2] : 0),
+                                                                                                                                 BTH(B_th),
+                                                                                                                                 shiftSteps(shiftSteps),
+                                                                                                                                 heterodyneSteps(TWO_STEP_HETERODYNE),
+                                                                                                                                 stepNum(stepNum),
+                                                                                                                                 phaseType(phaseType),
+                                                                                                                                 freqs(freqs),
+                                                                                                                                 unwrapMethod(unwrapMethod),
+                                                                                                                                 unwrapTH(unwrapTH),
+                                                                                                                                 filterSize(PHASE_FILTER_WINSIZE)
+{
+}
+
+phaseQuality::phaseQuality(int flags) : flags(flags)
+{
+}
+
+phaseCalculator::phaseCalculator(const pmpConfig &cfg) : workspace(NULL),
+                                                         instrument(NULL)
 {
     updateConfig(cfg);
 }
@@ -21,95 +47,609 @@ phaseCalculator::~phaseCalculator()
 {
 }
 
-// Calcuate relative phase according to phase shift steps.
-void phaseCalculator::calRelPhase_3step(const vector<Mat> &stripImg, Mat &relPhaseMap)
+// Relative phase of a row. Float uses the vectorized kernels, double uses library atan2.
+static inline void relPhase3(const uchar *const *I, float *dst, int cols, float modTH2)
+{
+    phaseKernels::relPhase3(I[0], I[1], I[2], dst, cols, modTH2);
+}
+
+static inline void relPhase3(const uchar *const *I, double *dst, int cols, double modTH2)
+{
+    for (int j = 0; j < cols; ++j)
+    {
+        double y = ROOT_THREE * (I[0][j] - I[1][j]);
+        double x = 2.0 * I[1][j] - I[0][j] - I[2][j];
+        dst[j] = (y * y + x * x < modTH2) ? NAN : atan2(y, x);
+    }
+}
+
+static inline void relPhase4(const uchar *const *I, float *dst, int cols, float modTH2)
+{
+    phaseKernels::relPhase4(I[0], I[1], I[2], I[3], dst, cols, modTH2);
+}
+
+static inline void relPhase4(const uchar *const *I, double *dst, int cols, double modTH2)
+{
+    for (int j = 0; j < cols; ++j)
+    {
+        double y = I[3][j] - I[1][j];
+        double x = I[0][j] - I[2][j];
+        dst[j] = (y * y + x * x < modTH2) ? NAN : atan2(y, x);
+    }
+}
+
+static inline void wrapPhase(const float *y, const float *x, float *dst, int cols, float modTH2)
+{
+    phaseKernels::wrapPhase(y, x, dst, cols, modTH2);
+}
+
+static inline void wrapPhase(const double *y, const double *x, double *dst, int cols, double modTH2)
+{
+    for (int j = 0; j < cols; ++j)
+        dst[j] = (y[j] * y[j] + x[j] * x[j] < modTH2) ? NAN : atan2(y[j], x[j]);
+}
+
+// Mean of center and the symmetric tap pairs whose taps at distance d are both within th of the line c -+ s * d, s the
+// slope of the flatter side of the nearest pair. NaN center gives NaN. Pairs keep the mean unbiased on phase ramps,
+// the line lets far taps count on fine fringes, and th keeps steps.
+template <typename T>
+static inline void smoothRow(const T *center, const T *const *taps, int pairNum, T *dst, int cols, T th)
+{
+    for (int j = 0; j < cols; ++j)
+    {
+        T c = center[j], sum = c, s = 0, line = 0;
+        int cnt = 1;
+        // NaN or over pi slope counts as flat.
+        if (pairNum)
+        {
+            T a = taps[0][j], b = taps[1][j];
+            s = (abs(c - a) < abs(b - c)) ? c - a : b - c;
+            s = (abs(s) < (T)(PI_2 / 2)) ? s : 0;
+        }
+        for (int k = 0; k < pairNum; ++k)
+        {
+            T a = taps[2 * k][j], b = taps[2 * k + 1][j];
+            line += s;
+            bool ok = (abs(a - c + line) < th) & (abs(b - c - line) < th);
+            sum += ok ? a + b : 0;
+            cnt += ok ? 2 : 0;
+        }
+        dst[j] = sum / cnt;
+    }
+}
+
+static inline void smoothRow(const float *center, const float *const *taps, int pairNum, float *dst, int cols, float th)
+{
+    phaseKernels::smoothPhase(center, taps, pairNum, dst, cols, th);
+}
+
+// Smooth a row along itself with radius r. Border columns use the pairs inside the row.
+template <typename T>
+static void smoothRowH(const T *src, T *dst, int cols, int r, T th)
+{
+    const T *taps[PHASE_FILTER_MAXSIZE];
+    int b = min(r, cols), e = max(cols - r, b);
+    for (int d = 1; d <= r; ++d)
+    {
+        taps[2 * d - 2] = src + b - d;
+        taps[2 * d - 1] = src + b + d;
+    }
+    smoothRow(src + b, taps, r, dst + b, e - b, th);
+    for (int j = b > 0 ? 0 : e; j < cols; j = (j + 1 == b) ? e : j + 1)
+    {
+        int pairs = min(min(j, cols - 1 - j), r);
+        for (int d = 1; d <= pairs; ++d)
+        {
+            taps[2 * d - 2] = src + j - d;
+            taps[2 * d - 1] = src + j + d;
+        }
+        smoothRow(src + j, taps, pairs, dst + j, 1, th);
+    }
+}
+
+// Fix isolated fringe order errors of row i. A pixel is off by k fringes if over 3/4 of its valid 8-neighbours
+// are off by the same k != 0. Neighbours out of src are invalid. Return the number of fixed pixels.
+template <typename T>
+static long fixOrderRow(const Mat &src, int i, T *dst)
+{
+    int cols = src.cols;
+    const T *S = src.ptr<T>(i);
+    const T *rows[3] = {i > 0 ? src.ptr<T>(i - 1) : NULL, S, i + 1 < src.rows ? src.ptr<T>(i + 1) : NULL};
+    long fixed = 0;
+    for (int j = 0; j < cols; ++j)
+    {
+        T p = S[j];
+        dst[j] = p;
+        // Pixels within pi of both row neighbours can not pass the vote.
+        if (j > 0 && j + 1 < cols && abs(S[j - 1] - p) < (T)(PI_2 / 2) && abs(S[j + 1] - p) < (T)(PI_2 / 2))
+            continue;
+        if (isnan(p))
+            continue;
+        int valid = 0, agree = 0, k = 0;
+        for (int u = 0; u < 3; ++u)
+        {
+            if (!rows[u])
+                continue;
+            for (int v = max(j - 1, 0); v <= min(j + 1, cols - 1); ++v)
+            {
+                T d = rows[u][v] - p;
+                if ((u == 1 && v == j) || isnan(d))
+                    continue;
+                ++valid;
+                int order = (int)round(d / (T)PI_2);
+                if (order && !k)
+                    k = order;
+                agree += order && order == k;
+            }
+        }
+        if (k && valid >= 3 && 4 * agree > 3 * valid)
+        {
+            dst[j] = p + k * (T)PI_2;
+            ++fixed;
+        }
+    }
+    return fixed;
+}
+
+// Phase filter of a tile. Fringe orders are fixed into corrected, then taps passing the threshold of smoothRow are averaged
+// along rows into smoothed and along columns into dst. Row t of dst holds row o0 + t of src, for rows [o0, o1).
+// NaN pixels stay NaN and are never taps, so invalid pixels do not spread. dst may overlap src.
+// Rows of dst are exact if src holds winSize / 2 + 1 rows around them. Fixed pixels of dst are counted to ins.
+template <typename T>
+static void phaseFilter(const Mat &src, Mat &corrected, Mat &smoothed, int o0, int o1, Mat &dst, int winSize, pmpInstrument *ins)
+{
+    int r = winSize / 2, rows = src.rows, cols = src.cols;
+    T th = (T)PHASE_FILTER_TH;
+    long fixed = 0;
+    for (int i = 0; i < rows; ++i)
+    {
+        long n = fixOrderRow<T>(src, i, corrected.ptr<T>(i));
+        fixed += (i >= o0 && i < o1) ? n : 0;
+    }
+    for (int i = max(o0 - r, 0); i < min(o1 + r, rows); ++i)
+        smoothRowH(corrected.ptr<T>(i), smoothed.ptr<T>(i), cols, r, th);
+    const T *taps[PHASE_FILTER_MAXSIZE];
+    for (int i = o0; i < o1; ++i)
+    {
+        int pairs = min(min(i, rows - 1 - i), r);
+        for (int d = 1; d <= pairs; ++d)
+        {
+            taps[2 * d - 2] = smoothed.ptr<T>(i - d);
+            taps[2 * d - 1] = smoothed.ptr<T>(i + d);
+        }
+        smoothRow(smoothed.ptr<T>(i), taps, pairs, dst.ptr<T>(i - o0), cols, th);
+    }
+    PMP_COUNT(ins, COUNT_ORDER_FIXED, fixed);
+}
+
+// Unwrap confidence of a fringe order residual in [-0.5, 0.5]. NaN gives 0.
+template <typename T>
+static inline uchar unwrapConfidence(T residual)
+{
+    T c = (T)255 * (1 - 2 * abs(residual)) + (T)0.5;
+    return (c >= 1) ? (uchar)c : 0;
+}
+
+// Create quality maps selected by flags.
+static void createQuality(phaseQuality *quality, Size size, int flags)
+{
+    if (!quality)
+        return;
+    if (quality->flags & flags & QUALITY_MODULATION)
+        quality->modulation.create(size, CV_8UC1);
+    if (quality->flags & flags & QUALITY_TEXTURE)
+        quality->texture.create(size, CV_8UC1);
+    if (quality->flags & flags & QUALITY_CONFIDENCE)
+        quality->confidence.create(size, CV_8UC1);
+}
+
+// Row pointer of a quality map, null if not selected.
+static inline uchar *qualityRow(phaseQuality *quality, int flag, int row)
+{
+    if (!quality || !(quality->flags & flag))
+        return NULL;
+    Mat &map = (flag == QUALITY_MODULATION) ? quality->modulation : (flag == QUALITY_TEXTURE) ? quality->texture : quality->confidence;
+    return map.ptr<uchar>(row);
+}
+
+// Spans of a row. A null mask gives whole, one span over the row.
+static inline int maskSpans(const spanMask *mask, int row, const int *whole, const int *&spans)
+{
+    if (!mask)
+    {
+        spans = whole;
+        return 1;
+    }
+    spans = mask->rowSpans(row);
+    return mask->spanNum(row);
+}
+
+// Fill pixels out of spans with value.
+template <typename V>
+static inline void fillOutside(V *dst, int cols, const int *spans, int spanNum, V value)
+{
+    int j = 0;
+    for (int s = 0; s < spanNum; ++s)
+    {
+        for (; j < spans[2 * s]; ++j)
+            dst[j] = value;
+        j = spans[2 * s + 1];
+    }
+    for (; j < cols; ++j)
+        dst[j] = value;
+}
+
+static void checkMask(const spanMask *mask, Size size)
 {
-    // This pixel-to-pixel map may use SIMD or multithreading to improve proformance.
+    if (mask && mask->getSize() != size)
+    {
+        cout << "Mask must be of the size of images!" << endl;
+        throw exception();
+    }
+}
 
+// Invalid pixels of a CV_32FC1 or CV_64FC1 phase map.
+static inline long countPhaseNaN(const Mat &phase)
+{
+    long n = 0;
+    for (int i = 0; i < phase.rows; ++i)
+        n += (phase.depth() == CV_64F) ? countNaN(phase.ptr<double>(i), phase.cols) : countNaN(phase.ptr<float>(i), phase.cols);
+    return n;
+}
+
+// Calcuate relative phase according to phase shift steps.
+template <typename T, int SHIFT>
+void phaseCalculator::calRelPhaseMap(const vector<Mat> &stripImg, Mat &relPhaseMap, phaseQuality *quality, const spanMask *mask)
+{
     // Check integrity of image set.
-    if (stripImg.size() != 3)
+    if ((int)stripImg.size() != stepNum)
     {
         cout << "Error image number!" << endl;
         throw exception();
     }
+    checkMask(mask, stripImg[0].size());
 
-    relPhaseMap = Mat(stripImg[0].size(), CV_TYPE);
-#pragma omp parallel for simd
-    for (int i = 0; i < stripImg[0].rows; ++i)
-        for (int j = 0; j < stripImg[0].cols; ++j)
-        {
-            uchar I1, I2, I3;
-            TYPE y, x, b;
-            I1 = stripImg[0].at<uchar>(i, j);
-            I2 = stripImg[1].at<uchar>(i, j);
-            I3 = stripImg[2].at<uchar>(i, j);
-            y = ROOT_THREE * (I1 - I2);
-            x = 2.0 * I2 - I1 - I3;
-            b = TWO_THIRD * sqrt(pow(y, 2) + pow(x, 2));
-            if (b < BTH)
-                relPhaseMap.at<TYPE>(i, j) = NAN;
-            else
-                relPhaseMap.at<TYPE>(i, j) = atan2(y, x);
+    int cols = stripImg[0].cols;
+    relPhaseMap.create(stripImg[0].size(), DataType<T>::type);
+    createQuality(quality, relPhaseMap.size(), QUALITY_MODULATION | QUALITY_TEXTURE);
+    // Scratch slots are reserved here, as nothing may throw in the parallel region.
+    scratchBuffer<const uchar *>::reserve(workspace, 0, stepNum);
+    scratchBuffer<T>::reserve(workspace, 1, SHIFT == N_STEP_SHIFT ? 2 * cols : 0);
+#pragma omp parallel
+    {
+        scratchBuffer<const uchar *> I(workspace, 0, stepNum);
+        scratchBuffer<T> buf(workspace, 1, SHIFT == N_STEP_SHIFT ? 2 * cols : 0);
+        int whole[2] = {0, cols};
+#pragma omp for
+        for (int i = 0; i < stripImg[0].rows; ++i)
+        {
+            PMP_ROWS(instrument, STAGE_WRAP, 1);
+            const int *spans;
+            int spanNum = maskSpans(mask, i, whole, spans);
+            T *dst = relPhaseMap.ptr<T>(i);
+            uchar *modulation = qualityRow(quality, QUALITY_MODULATION, i), *texture = qualityRow(quality, QUALITY_TEXTURE, i);
+            if (mask)
+            {
+                fillOutside(dst, cols, spans, spanNum, (T)NAN);
+                if (modulation)
+                    fillOutside(modulation, cols, spans, spanNum, (uchar)0);
+                if (texture)
+                    fillOutside(texture, cols, spans, spanNum, (uchar)0);
+            }
+            for (int s = 0; s < spanNum; ++s)
+            {
+                int b = spans[2 * s], w = spans[2 * s + 1] - b;
+                for (int n = 0; n < stepNum; ++n)
+                    I[n] = stripImg[n].ptr<uchar>(i) + b;
+                calRelPhaseRow<T, SHIFT>(I.data(), dst + b, buf.data(), w);
+                if (quality)
+                    calQualityRow<T, SHIFT>(I.data(), buf.data(), modulation ? modulation + b : NULL, texture ? texture + b : NULL, w);
+                PMP_COUNT(instrument, COUNT_PHASE_PIXELS, w);
+                PMP_COUNT(instrument, COUNT_LOW_MODULATION, countNaN(dst + b, w));
+            }
         }
+    }
 }
 
-void phaseCalculator::calRelPhase_4step(const vector<Mat> &stripImg, Mat &relPhaseMap)
+template <typename T>
+void phaseCalculator::calRelPhaseType(const vector<Mat> &stripImg, Mat &relPhaseMap, phaseQuality *quality, const spanMask *mask)
 {
-    // This pixel-to-pixel map may use SIMD or multithreading to improve proformance.
+    if (shiftSteps == N_STEP_SHIFT)
+        calRelPhaseMap<T, N_STEP_SHIFT>(stripImg, relPhaseMap, quality, mask);
+    else if (shiftSteps == FOUR_STEP_SHIFT)
+        calRelPhaseMap<T, FOUR_STEP_SHIFT>(stripImg, relPhaseMap, quality, mask);
+    else
+        calRelPhaseMap<T, THREE_STEP_SHIFT>(stripImg, relPhaseMap, quality, mask);
+}
 
-    // Check integrity of image set.
-    if (stripImg.size() != 4)
+template <typename T, int SHIFT>
+void phaseCalculator::calMaskMap(const vector<Mat> &stripImg, vector<vector<int>> &rowSpans)
+{
+    int cols = stripImg[0].cols;
+    scratchBuffer<const uchar *>::reserve(workspace, 0, stepNum);
+    scratchBuffer<T>::reserve(workspace, 1, cols);
+    scratchBuffer<T>::reserve(workspace, 2, SHIFT == N_STEP_SHIFT ? 2 * cols : 0);
+#pragma omp parallel
+    {
+        scratchBuffer<const uchar *> I(workspace, 0, stepNum);
+        scratchBuffer<T> mod2(workspace, 1, cols), buf(workspace, 2, SHIFT == N_STEP_SHIFT ? 2 * cols : 0);
+        T th = (T)modTH2;
+#pragma omp for
+        for (int i = 0; i < stripImg[0].rows; ++i)
+        {
+            PMP_ROWS(instrument, STAGE_WRAP, 1);
+            for (int n = 0; n < stepNum; ++n)
+                I[n] = stripImg[n].ptr<uchar>(i);
+            // Same modulation test as calRelPhaseRow, without the phase.
+            calModulationRow<T, SHIFT>(I.data(), mod2.data(), buf.data(), cols);
+            const T *m = mod2.data();
+            appendSpans(cols, [&](int j) { return !(m[j] < th); }, rowSpans[i]);
+        }
+    }
+}
+
+void phaseCalculator::calMask(const vector<Mat> &stripImg, spanMask &mask)
+{
+    PMP_CALL(instrument);
+    if ((int)stripImg.size() < stepNum)
     {
         cout << "Error image number!" << endl;
         throw exception();
     }
 
-    relPhaseMap = Mat(stripImg[0].size(), CV_TYPE);
+    vector<vector<int>> rowSpans(stripImg[0].rows);
+    if (shiftSteps == N_STEP_SHIFT)
+        calMaskMap<float, N_STEP_SHIFT>(stripImg, rowSpans);
+    else if (shiftSteps == FOUR_STEP_SHIFT)
+        calMaskMap<float, FOUR_STEP_SHIFT>(stripImg, rowSpans);
+    else
+        calMaskMap<float, THREE_STEP_SHIFT>(stripImg, rowSpans);
+    mask.build(stripImg[0].size(), rowSpans);
+}
+
+template <typename T, int SHIFT>
+void phaseCalculator::calRelPhaseRow(const uchar *const *I, T *dst, T *buf, int cols) const
+{
+    if (SHIFT == THREE_STEP_SHIFT)
+        relPhase3(I, dst, cols, (T)modTH2);
+    else if (SHIFT == FOUR_STEP_SHIFT)
+        relPhase4(I, dst, cols, (T)modTH2);
+    else
+    {
+        accumulateRow(I, buf, cols);
+        wrapPhase(buf, buf + cols, dst, cols, (T)modTH2);
+    }
+}
 
-#pragma omp parallel for simd
-    for (int i = 0; i < stripImg[0].rows; ++i)
-        for (int j = 0; j < stripImg[0].cols; ++j)
+template <typename T>
+void phaseCalculator::accumulateRow(const uchar *const *I, T *buf, int cols) const
+{
+    // Accumulate all images in one pass over the row.
+    T *y = buf, *x = buf + cols;
+    T s = sinTable[0], c = cosTable[0];
+#pragma omp simd
+    for (int j = 0; j < cols; ++j)
+    {
+        y[j] = s * I[0][j];
+        x[j] = c * I[0][j];
+    }
+    for (int n = 1; n < stepNum; ++n)
+    {
+        const uchar *In = I[n];
+        s = sinTable[n];
+        c = cosTable[n];
+#pragma omp simd
+        for (int j = 0; j < cols; ++j)
         {
-            uchar I1, I2, I3, I4;
-            TYPE y, x, b;
-            I1 = stripImg[0].at<uchar>(i, j);
-            I2 = stripImg[1].at<uchar>(i, j);
-            I3 = stripImg[2].at<uchar>(i, j);
-            I4 = stripImg[3].at<uchar>(i, j);
-            y = I4 - I2;
-            x = I1 - I3;
-            b = 0.5 * sqrt(pow(y, 2) + pow(x, 2));
-            if (b < BTH)
-                relPhaseMap.at<TYPE>(i, j) = NAN;
-            else
-                relPhaseMap.at<TYPE>(i, j) = atan2(y, x);
+            y[j] += s * In[j];
+            x[j] += c * In[j];
         }
+    }
+}
+
+template <typename T, int SHIFT>
+void phaseCalculator::calModulationRow(const uchar *const *I, T *mod2, T *buf, int cols) const
+{
+    if (SHIFT == THREE_STEP_SHIFT)
+    {
+#pragma omp simd
+        for (int j = 0; j < cols; ++j)
+        {
+            T y = (T)ROOT_THREE * (I[0][j] - I[1][j]), x = (T)2 * I[1][j] - I[0][j] - I[2][j];
+            mod2[j] = y * y + x * x;
+        }
+    }
+    else if (SHIFT == FOUR_STEP_SHIFT)
+    {
+#pragma omp simd
+        for (int j = 0; j < cols; ++j)
+        {
+            T y = I[3][j] - I[1][j], x = I[0][j] - I[2][j];
+            mod2[j] = y * y + x * x;
+        }
+    }
+    else
+    {
+        accumulateRow(I, buf, cols);
+        const T *y = buf, *x = buf + cols;
+#pragma omp simd
+        for (int j = 0; j < cols; ++j)
+            mod2[j] = y[j] * y[j] + x[j] * x[j];
+    }
+}
+
+template <typename T, int SHIFT>
+void phaseCalculator::calQualityRow(const uchar *const *I, const T *buf, uchar *modulation, uchar *texture, int cols) const
+{
+    // b = 2 / N * sqrt(y^2 + x^2), with the y and x of calRelPhaseRow. N-step y and x are left in buf.
+    if (modulation)
+    {
+        if (SHIFT == THREE_STEP_SHIFT)
+        {
+#pragma omp simd
+            for (int j = 0; j < cols; ++j)
+            {
+                T y = (T)ROOT_THREE * (I[0][j] - I[1][j]), x = (T)2 * I[1][j] - I[0][j] - I[2][j];
+                modulation[j] = (uchar)min((T)TWO_THIRD * sqrt(y * y + x * x) + (T)0.5, (T)255);
+            }
+        }
+        else if (SHIFT == FOUR_STEP_SHIFT)
+        {
+#pragma omp simd
+            for (int j = 0; j < cols; ++j)
+            {
+                T y = I[3][j] - I[1][j], x = I[0][j] - I[2][j];
+                modulation[j] = (uchar)min((T)0.5 * sqrt(y * y + x * x) + (T)0.5, (T)255);
+            }
+        }
+        else
+        {
+            const T *y = buf, *x = buf + cols;
+            T scale = (T)2 / stepNum;
+#pragma omp simd
+            for (int j = 0; j < cols; ++j)
+                modulation[j] = (uchar)min(scale * sqrt(y[j] * y[j] + x[j] * x[j]) + (T)0.5, (T)255);
+        }
+    }
+    // a = sum(I[n]) / N.
+    if (texture)
+    {
+        if (SHIFT == THREE_STEP_SHIFT)
+        {
+#pragma omp simd
+            for (int j = 0; j < cols; ++j)
+                texture[j] = (uchar)((I[0][j] + I[1][j] + I[2][j] + 1) / 3);
+        }
+        else if (SHIFT == FOUR_STEP_SHIFT)
+        {
+#pragma omp simd
+            for (int j = 0; j < cols; ++j)
+                texture[j] = (uchar)((I[0][j] + I[1][j] + I[2][j] + I[3][j] + 2) >> 2);
+        }
+        else
+        {
+            int steps = stepNum;
+            for (int j = 0; j < cols; ++j)
+            {
+                int sum = steps / 2;
+                for (int n = 0; n < steps; ++n)
+                    sum += I[n][j];
+                texture[j] = (uchar)(sum / steps);
+            }
+        }
+    }
 }
 
 // Calcuate heterodyne phase according to phase shift steps.
-TYPE phaseCalculator::calHeterodynePhase_2step(const TYPE &phase1, const TYPE &phase2, const TYPE &phase3) const
+template <typename T>
+T phaseCalculator::calHeterodynePhase_2step(T phase1, T phase2, T phase3, T &residual) const
 {
-    // This pixel-to-pixel map may use SIMD or multithreading to improve proformance.
-    TYPE phase12, phase123;
+    T phase12, phase123;
     phase12 = heterodyne(phase1, phase2);
     phase123 = heterodyne(phase12, phase3);
-    return phase123;
+    T order = (phase123 * (T)ratio_3to2 - phase12) / PI_2, rounded = round(order);
+    residual = order - rounded;
+    return phase12 + PI_2 * rounded;
 }
 
-TYPE phaseCalculator::calHeterodynePhase_3step(const TYPE &phase1, const TYPE &phase2, const TYPE &phase3) const
+template <typename T>
+T phaseCalculator::calHeterodynePhase_3step(T phase1, T phase2, T phase3, T &residual) const
 {
-    // This pixel-to-pixel map may use SIMD or multithreading to improve proformance.
-    TYPE phase13, phase23, phase123;
+    T phase13, phase23, phase123;
     phase13 = heterodyne(phase1, phase3);
     phase23 = heterodyne(phase2, phase3);
     phase123 = heterodyne(phase13, phase23);
-    return phase123;
+    T order = (phase123 * (T)ratio_3to2 - phase13) / PI_2, rounded = round(order);
+    residual = order - rounded;
+    return phase13 + PI_2 * rounded;
+}
+
+template <typename T>
+T phaseCalculator::heterodyne(T phase1, T phase2)
+{
+    // phase1 may be a heterodyne phase in [0, 2 * pi), so z is in (-2 * pi, 3 * pi).
+    T z = phase1 - phase2;
+    return (z < 0) ? (z + PI_2) : (z >= PI_2) ? (z - PI_2) : z;
+}
+
+template <typename T, bool HET>
+void phaseCalculator::calAbsPhaseRowN(const T *const *phase, T *dst, uchar *conf, int cols, int stop) const
+{
+    int n = freqNum;
+    const double *ratio = &unwrapRatio[0];
+    T th = unwrapTH;
+    for (int j = 0; j < cols; ++j)
+    {
+        // Wrapped phase of each level. Heterodyne levels are beat phases in [0, 2 * pi).
+        T level[MAX_FREQ_NUM];
+        level[0] = phase[0][j];
+        for (int k = 1; k < n; ++k)
+            level[k] = HET ? heterodyne(level[k - 1], phase[k][j]) : phase[k][j];
+        // The coarsest level has at most one period, so its phase in [0, 2 * pi) is absolute.
+        T phi = heterodyne(level[n - 1], (T)0), maxResidual = 0;
+        for (int k = n - 2; k >= stop; --k)
+        {
+            T order = (phi * (T)ratio[k] - level[k]) / (T)PI_2;
+            T rounded = round(order), residual = abs(order - rounded);
+            // A pixel off the fringe order grid is unreliable. NaN fails the test too, so invalid pixels exit early.
+            if (!(residual <= th))
+            {
+                phi = NAN;
+                break;
+            }
+            phi = level[k] + (T)PI_2 * rounded;
+            maxResidual = max(maxResidual, residual);
+        }
+        dst[j] = phi;
+        if (conf)
+            conf[j] = isnan(phi) ? 0 : unwrapConfidence(maxResidual);
+    }
+}
+
+template <typename T, bool HET3>
+void phaseCalculator::unwrapRow(const T *const *phase, T *dst, uchar *conf, int cols) const
+{
+    if (!multiFreq)
+        conf ? calAbsPhaseRow<T, HET3, true>(phase[0], phase[1], phase[2], dst, conf, cols) : calAbsPhaseRow<T, HET3, false>(phase[0], phase[1], phase[2], dst, conf, cols);
+    else if (unwrapMethod == HETERODYNE_UNWRAP)
+        calAbsPhaseRowN<T, true>(phase, dst, conf, cols, 0);
+    else
+        calAbsPhaseRowN<T, false>(phase, dst, conf, cols, 0);
 }
 
-TYPE phaseCalculator::heterodyne(const TYPE &phase1, const TYPE &phase2) const
+template <typename T, bool HET3>
+void phaseCalculator::calGuidedRow(const T *const *phase, int phaseNum, const T *ref, const uchar *mask, T *dst, int cols) const
 {
-    TYPE z = phase1 - phase2;
-    return (z < 0) ? (z + PI_2) : z;
+    const T *phase1 = phase[0];
+    T th = unwrapTH;
+    int missed = 0;
+    for (int j = 0; j < cols; ++j)
+    {
+        T order = (ref[j] - phase1[j]) / (T)PI_2;
+        T rounded = round(order);
+        bool hit = (!mask || mask[j]) && abs(order - rounded) <= th;
+        dst[j] = hit ? phase1[j] + (T)PI_2 * rounded : (T)NAN;
+        // Invalid phase stays invalid with all frequencies, so it is not missed.
+        missed += !hit && !isnan(phase1[j]);
+    }
+    if (!missed || phaseNum == 1)
+        return;
+    // Missed pixels fall back to all frequencies, one run of them at a time.
+    const T *run[MAX_FREQ_NUM];
+    for (int j = 0; j < cols;)
+    {
+        if (!isnan(dst[j]) || isnan(phase1[j]))
+        {
+            ++j;
+            continue;
+        }
+        int b = j;
+        while (j < cols && isnan(dst[j]) && !isnan(phase1[j]))
+            ++j;
+        for (int k = 0; k < phaseNum; ++k)
+            run[k] = phase[k] + b;
+        unwrapRow<T, HET3>(run, dst + b, NULL, j - b);
+    }
 }
 
 // Update pmp algorithm parameters.
@@ -117,9 +657,59 @@ void phaseCalculator::updateConfig(const pmpConfig &cfg)
 {
     // N-Step algorithm.
     shiftSteps = cfg.shiftSteps;
+    multiFreq = !cfg.freqs.empty();
+    freqNum = multiFreq ? cfg.freqs.size() : 3;
+    unwrapMethod = cfg.unwrapMethod;
+    unwrapTH = cfg.unwrapTH;
+    if (multiFreq && (freqNum < 2 || freqNum > MAX_FREQ_NUM))
+    {
+        cout << "Frequency number must be 2 to MAX_FREQ_NUM!" << endl;
+        throw exception();
+    }
+    if (!(unwrapTH > 0 && unwrapTH <= 0.5))
+    {
+        cout << "Unwrap threshold must be in (0, 0.5]!" << endl;
+        throw exception();
+    }
+    if (cfg.filterSize < 1 || cfg.filterSize > PHASE_FILTER_MAXSIZE || cfg.filterSize % 2 == 0)
+    {
+        cout << "Phase filter size must be odd and up to PHASE_FILTER_MAXSIZE!" << endl;
+        throw exception();
+    }
+    filterSize = cfg.filterSize;
     heterodyneSteps = cfg.heterodyneSteps;
     BTH = cfg.BTH;
-    // Calcuate wave length ratios.YPE
+    if (shiftSteps == N_STEP_SHIFT)
+        stepNum = cfg.stepNum;
+    else
+        stepNum = (shiftSteps == FOUR_STEP_SHIFT) ? 4 : 3;
+    if (stepNum < 3)
+    {
+        cout << "Phase shift steps can not less than 3!" << endl;
+        throw exception();
+    }
+    if (cfg.phaseType != CV_32FC1 && cfg.phaseType != CV_64FC1 && cfg.phaseType != CV_16UC1)
+    {
+        cout << "Phase type must be CV_32FC1, CV_64FC1 or CV_16UC1!" << endl;
+        throw exception();
+    }
+    phaseType = cfg.phaseType;
+    // Absolute phase lies in [-pi, 2 * pi * freq1 + pi).
+    fixedScale = (PHASE_INVALID - 1) / (PI_2 * ((multiFreq ? cfg.freqs[0] : cfg.freq1) + 1));
+
+    // Weight tables of N-step algorithm. Image n is shifted by 2 * pi * n / N.
+    sinTable.resize(stepNum);
+    cosTable.resize(stepNum);
+    for (int n = 0; n < stepNum; ++n)
+    {
+        sinTable[n] = -sin(PI_2 * n / stepNum);
+        cosTable[n] = cos(PI_2 * n / stepNum);
+    }
+
+    // b = 2 / N * sqrt(y^2 + x^2). 3-step kernel uses a scaled y and x, whose b = 2 / 3 * sqrt(y^2 + x^2).
+    double modScale = (shiftSteps == THREE_STEP_SHIFT) ? 1.5 : stepNum / 2.0;
+    modTH2 = (BTH > 0) ? (modScale * BTH) * (modScale * BTH) : 0;
+    // Calcuate wave length ratios.
     if (heterodyneSteps == TWO_STEP_HETERODYNE)
     {
         ratio_2to1 = cfg.freq1 / (cfg.freq1 - cfg.freq2);
@@ -132,107 +722,472 @@ void phaseCalculator::updateConfig(const pmpConfig &cfg)
         ratio_3to2 = cfg.freq1 - cfg.freq3;
         ratio_3to1 = cfg.freq1;
     }
+
+    // Ratio table of N-frequency unwrapping. F is the frequency of each level.
+    unwrapRatio.clear();
+    if (multiFreq)
+    {
+        vector<double> F(freqNum);
+        F[0] = cfg.freqs[0];
+        for (int k = 1; k < freqNum; ++k)
+            F[k] = (unwrapMethod == HETERODYNE_UNWRAP) ? F[k - 1] - cfg.freqs[k] : cfg.freqs[k];
+        for (int k = 1; k < freqNum; ++k)
+            if (!(F[k] > 0 && F[k] < F[k - 1]))
+            {
+                cout << "Level frequencies must decrease and be positive!" << endl;
+                throw exception();
+            }
+        // Allow rounding of frequencies given in float.
+        if (F[freqNum - 1] > 1 + 1e-6)
+        {
+            cout << "Coarsest level must have at most one period!" << endl;
+            throw exception();
+        }
+        unwrapRatio.resize(freqNum - 1);
+        for (int k = 0; k < freqNum - 1; ++k)
+            unwrapRatio[k] = F[k] / F[k + 1];
+    }
+}
+
+void phaseCalculator::setWorkspace(pmpWorkspace *ws)
+{
+    workspace = ws;
+}
+
+pmpWorkspace *phaseCalculator::getWorkspace() const
+{
+    return workspace;
+}
+
+void phaseCalculator::setInstrument(pmpInstrument *ins)
+{
+    instrument = ins;
+}
+
+pmpInstrument *phaseCalculator::getInstrument() const
+{
+    return instrument;
+}
+
+double phaseCalculator::getFixedScale() const
+{
+    return fixedScale;
+}
+
+int phaseCalculator::getFilterHalo() const
+{
+    // Order fixing reads one row around the rows it smooths.
+    return filterSize / 2 + 1;
+}
+
+int phaseCalculator::getPhaseType() const
+{
+    return phaseType;
 }
 
 // Calculate relative phase map.
-void phaseCalculator::calRelPhase(const vector<Mat> &stripImg, Mat &relPhaseMap)
+void phaseCalculator::calRelPhase(const vector<Mat> &stripImg, Mat &relPhaseMap, phaseQuality *quality, const spanMask *mask)
 {
-    if (shiftSteps == FOUR_STEP_SHIFT)
-        calRelPhase_4step(stripImg, relPhaseMap);
+    PMP_CALL(instrument);
+    // Relative phase of fixed-point mode is float.
+    if (phaseType == CV_64FC1)
+        calRelPhaseType<double>(stripImg, relPhaseMap, quality, mask);
     else
-        calRelPhase_3step(stripImg, relPhaseMap);
+        calRelPhaseType<float>(stripImg, relPhaseMap, quality, mask);
 }
 
-void phaseCalculator::calHeterodynePhase(const std::vector<cv::Mat> &relPhaseMap, cv::Mat &hetetodynePhaseMap)
+static void checkPhaseMaps(const vector<Mat> &relPhaseMap, size_t num)
+{
+    // Check if relPhaseMap have correct phase maps.
+    if (relPhaseMap.size() != num)
+    {
+        cout << "The number of phase maps is wrong!" << endl;
+        throw exception();
+    }
+    for (size_t k = 0; k < num; ++k)
+        if ((relPhaseMap[k].type() != CV_32FC1 && relPhaseMap[k].type() != CV_64FC1) || relPhaseMap[k].type() != relPhaseMap[0].type() || relPhaseMap[k].size() != relPhaseMap[0].size())
+        {
+            cout << "Phase maps must be CV_32FC1 or CV_64FC1 of the same size!" << endl;
+            throw exception();
+        }
+}
+
+template <typename T, bool HET3>
+void phaseCalculator::calHeterodyneMap(const vector<Mat> &relPhaseMap, Mat &hetetodynePhaseMap)
 {
     // Allocate memory for hetetodynePhaseMap.
-    hetetodynePhaseMap.create(relPhaseMap[0].size(), CV_TYPE);
+    hetetodynePhaseMap.create(relPhaseMap[0].size(), DataType<T>::type);
 
-// Calculate heterodyne phase and use it to unwrap relative phase.
-#pragma omp parallel for simd
+// NaN of any phase propagates through heterodyne and round, so invalid pixels need no branch.
+#pragma omp parallel for
     for (int i = 0; i < hetetodynePhaseMap.rows; ++i)
     {
+        PMP_ROWS(instrument, STAGE_UNWRAP, 1);
+        if (multiFreq)
+        {
+            const T *phase[MAX_FREQ_NUM];
+            for (int k = 0; k < freqNum; ++k)
+                phase[k] = relPhaseMap[k].ptr<T>(i);
+            // Unwrap down to the level that unwraps freqs[0].
+            if (unwrapMethod == HETERODYNE_UNWRAP)
+                calAbsPhaseRowN<T, true>(phase, hetetodynePhaseMap.ptr<T>(i), NULL, hetetodynePhaseMap.cols, 1);
+            else
+                calAbsPhaseRowN<T, false>(phase, hetetodynePhaseMap.ptr<T>(i), NULL, hetetodynePhaseMap.cols, 1);
+            continue;
+        }
+        const T *phase1 = relPhaseMap[0].ptr<T>(i), *phase2 = relPhaseMap[1].ptr<T>(i), *phase3 = relPhaseMap[2].ptr<T>(i);
+        T *dst = hetetodynePhaseMap.ptr<T>(i);
+#pragma omp simd
         for (int j = 0; j < hetetodynePhaseMap.cols; ++j)
         {
-            TYPE phase123;
-            TYPE phase1 = relPhaseMap[0].at<TYPE>(i, j);
-            TYPE phase2 = relPhaseMap[1].at<TYPE>(i, j);
-            TYPE phase3 = relPhaseMap[2].at<TYPE>(i, j);
+            T residual;
+            dst[j] = HET3 ? calHeterodynePhase_3step(phase1[j], phase2[j], phase3[j], residual) : calHeterodynePhase_2step(phase1[j], phase2[j], phase3[j], residual);
+        }
+    }
+}
 
-            if (isnan(phase1) | isnan(phase2) | isnan(phase3))
-                hetetodynePhaseMap.at<TYPE>(i, j) = NAN;
-            else
+void phaseCalculator::calHeterodynePhase(const std::vector<cv::Mat> &relPhaseMap, cv::Mat &hetetodynePhaseMap)
+{
+    PMP_CALL(instrument);
+    checkPhaseMaps(relPhaseMap, freqNum);
+    bool het3 = heterodyneSteps == THREE_STEP_HETERODYNE;
+    if (relPhaseMap[0].depth() == CV_64F)
+        het3 ? calHeterodyneMap<double, true>(relPhaseMap, hetetodynePhaseMap) : calHeterodyneMap<double, false>(relPhaseMap, hetetodynePhaseMap);
+    else
+        het3 ? calHeterodyneMap<float, true>(relPhaseMap, hetetodynePhaseMap) : calHeterodyneMap<float, false>(relPhaseMap, hetetodynePhaseMap);
+}
+
+template <typename T, bool HET3, bool CONF>
+void phaseCalculator::calAbsPhaseRow(const T *phase1, const T *phase2, const T *phase3, T *dst, uchar *conf, int cols) const
+{
+    T ratio = ratio_2to1;
+    // NaN of any phase propagates through heterodyne and round, so invalid pixels need no branch.
+#pragma omp simd
+    for (int j = 0; j < cols; ++j)
+    {
+        T hetResidual;
+        T hetPhase = HET3 ? calHeterodynePhase_3step(phase1[j], phase2[j], phase3[j], hetResidual) : calHeterodynePhase_2step(phase1[j], phase2[j], phase3[j], hetResidual);
+        T order = (hetPhase * ratio - phase1[j]) / PI_2, rounded = round(order);
+        dst[j] = phase1[j] + PI_2 * rounded;
+        // NaN residual gives 0.
+        if (CONF)
+            conf[j] = unwrapConfidence(max(abs(hetResidual), abs(order - rounded)));
+    }
+}
+
+template <typename T, bool HET3>
+void phaseCalculator::unwrapMapRow(const vector<Mat> &relPhaseMap, const Mat &refPhase, const Mat &mask, int i, T *dst, uchar *conf, const spanMask *spans, T *refBuf)
+{
+    int cols = relPhaseMap[0].cols;
+    const T *phase[MAX_FREQ_NUM];
+    if (!refPhase.empty())
+    {
+        for (size_t k = 0; k < relPhaseMap.size(); ++k)
+            phase[k] = relPhaseMap[k].ptr<T>(i);
+        const T *ref;
+        if (refPhase.type() == CV_16UC1)
+        {
+            decodePhaseRow(refPhase.ptr<ushort>(i), refBuf, cols, (T)fixedScale);
+            ref = refBuf;
+        }
+        else
+            ref = refPhase.ptr<T>(i);
+        calGuidedRow<T, HET3>(phase, relPhaseMap.size(), ref, mask.empty() ? NULL : mask.ptr<uchar>(i), dst, cols);
+        return;
+    }
+
+    // Calculate heterodyne phase and use it to unwrap relative phase.
+    int whole[2] = {0, cols};
+    const int *s;
+    int spanNum = maskSpans(spans, i, whole, s);
+    if (spans)
+    {
+        fillOutside(dst, cols, s, spanNum, (T)NAN);
+        if (conf)
+            fillOutside(conf, cols, s, spanNum, (uchar)0);
+    }
+    for (int n = 0; n < spanNum; ++n)
+    {
+        int b = s[2 * n];
+        for (int k = 0; k < freqNum; ++k)
+            phase[k] = relPhaseMap[k].ptr<T>(i) + b;
+        unwrapRow<T, HET3>(phase, dst + b, conf ? conf + b : NULL, s[2 * n + 1] - b);
+    }
+}
+
+// Calculate absolute phase map.
+void phaseCalculator::calAbsPhase(const vector<Mat> &relPhaseMap, Mat &absPhaseMap, bool filter, phaseQuality *quality, const spanMask *mask)
+{
+    PMP_CALL(instrument);
+    checkPhaseMaps(relPhaseMap, freqNum);
+    checkMask(mask, relPhaseMap[0].size());
+    createQuality(quality, relPhaseMap[0].size(), QUALITY_CONFIDENCE);
+    unwrapMaps(relPhaseMap, Mat(), Mat(), absPhaseMap, filter, (quality && (quality->flags & QUALITY_CONFIDENCE)) ? &quality->confidence : NULL, mask);
+}
+
+void phaseCalculator::calAbsPhaseGuided(const vector<Mat> &relPhaseMap, const Mat &refPhase, const Mat &mask, Mat &absPhaseMap, bool filter)
+{
+    PMP_CALL(instrument);
+    checkPhaseMaps(relPhaseMap, relPhaseMap.size() == 1 ? 1 : freqNum);
+    if (refPhase.type() != phaseType || refPhase.size() != relPhaseMap[0].size() || (phaseType != CV_16UC1 && refPhase.type() != relPhaseMap[0].type()))
+    {
+        cout << "Reference phase must be of phase type and of the size of phase maps!" << endl;
+        throw exception();
+    }
+    if (!mask.empty() && (mask.type() != CV_8UC1 || mask.size() != relPhaseMap[0].size()))
+    {
+        cout << "Mask must be CV_8UC1 of the size of phase maps!" << endl;
+        throw exception();
+    }
+    unwrapMaps(relPhaseMap, refPhase, mask, absPhaseMap, filter, NULL, NULL);
+}
+
+template <typename T, bool HET3>
+void phaseCalculator::unwrapTiles(const vector<Mat> &relPhaseMap, const Mat &refPhase, const Mat &mask, Mat &absPhaseMap, bool filter, Mat *confidence, const spanMask *spans)
+{
+    int rows = relPhaseMap[0].rows, cols = relPhaseMap[0].cols;
+    int type = DataType<T>::type;
+    // Fixed-point phase is calculated in tiles of T and encoded.
+    bool fixed = absPhaseMap.type() == CV_16UC1;
+    bool tiled = filter || fixed;
+    // Rows above and below a tile needed by phase filter.
+    int halo = filter ? getFilterHalo() : 0;
+    int tileNum = (rows + PHASE_TILE_ROWS - 1) / PHASE_TILE_ROWS;
+    size_t refElems = refPhase.type() == CV_16UC1 ? cols : 0;
+    int tileRows = tiled ? PHASE_TILE_ROWS + 2 * halo : 0;
+    size_t filterElems = filter ? (size_t)tileRows * cols : 0;
+    scratchBuffer<T>::reserve(workspace, 0, refElems);
+    scratchBuffer<T>::reserve(workspace, 1, (size_t)tileRows * cols);
+    scratchBuffer<T>::reserve(workspace, 2, filterElems);
+    scratchBuffer<T>::reserve(workspace, 3, filterElems);
+
+#pragma omp parallel
+    {
+        scratchBuffer<T> refBuf(workspace, 0, refElems);
+        scratchBuffer<T> absBuf(workspace, 1, (size_t)tileRows * cols), correctedBuf(workspace, 2, filterElems), smoothedBuf(workspace, 3, filterElems);
+        Mat absTile, corrected, smoothed;
+#pragma omp for schedule(dynamic)
+        for (int t = 0; t < tileNum; ++t)
+        {
+            int r0 = t * PHASE_TILE_ROWS, r1 = min(r0 + PHASE_TILE_ROWS, rows);
+            // Rows to unwrap, including filter halo.
+            int c0 = max(r0 - halo, 0), c1 = min(r1 + halo, rows);
+            if (tiled)
+                absTile = Mat(c1 - c0, cols, type, absBuf.data());
+            if (filter)
             {
-                if (heterodyneSteps == TWO_STEP_HETERODYNE)
-                {
-                    TYPE phase12, phase123, absPhase12;
-                    phase12 = heterodyne(phase1, phase2);
-                    phase123 = heterodyne(phase12, phase3);
-                    absPhase12 = phase12 + PI_2 * round((phase123 * ratio_3to2 - phase12) / PI_2);
-                    hetetodynePhaseMap.at<TYPE>(i, j) = absPhase12;
-                }
+                corrected = Mat(c1 - c0, cols, type, correctedBuf.data());
+                smoothed = Mat(c1 - c0, cols, type, smoothedBuf.data());
+            }
+
+            for (int i = c0; i < c1; ++i)
+            {
+                bool own = i >= r0 && i < r1;
+                PMP_ROWS(instrument, STAGE_UNWRAP, own);
+                T *dst = tiled ? absTile.ptr<T>(i - c0) : absPhaseMap.ptr<T>(i);
+                unwrapMapRow<T, HET3>(relPhaseMap, refPhase, mask, i, dst, (own && confidence) ? confidence->ptr<uchar>(i) : NULL, spans, refBuf.data());
+            }
+
+            // Phase filter on the tile, back into its own rows, as in calAbsPhaseTiles.
+            if (filter)
+            {
+                PMP_ROWS(instrument, STAGE_FILTER, r1 - r0);
+                Mat own = absTile.rowRange(r0 - c0, r1 - c0);
+                phaseFilter<T>(absTile, corrected, smoothed, r0 - c0, r1 - c0, own, filterSize, instrument);
+            }
+            const Mat &tile = absTile;
+            PMP_COUNT(instrument, COUNT_ABS_VALID, (long)(r1 - r0) * cols - (tiled ? countPhaseNaN(tile.rowRange(r0 - c0, r1 - c0)) : countPhaseNaN(absPhaseMap.rowRange(r0, r1))));
+            if (tiled)
+            {
+                if (fixed)
+                    for (int i = r0; i < r1; ++i)
+                        encodePhaseRow(tile.ptr<T>(i - c0), absPhaseMap.ptr<ushort>(i), cols, (T)fixedScale);
                 else
-                {
-                    TYPE absPhase13, phase13, phase23, phase123;
-                    phase13 = heterodyne(phase1, phase3);
-                    phase23 = heterodyne(phase2, phase3);
-                    phase123 = heterodyne(phase13, phase23);
-                    absPhase13 = phase13 + PI_2 * round((phase123 * ratio_3to2 - phase13) / PI_2);
-                    hetetodynePhaseMap.at<TYPE>(i, j) = absPhase13;
-                }
+                    tile.rowRange(r0 - c0, r1 - c0).copyTo(absPhaseMap.rowRange(r0, r1));
             }
         }
     }
 }
 
-// Calculate absolute phase map.
-void phaseCalculator::calAbsPhase(const vector<Mat> &relPhaseMap, Mat &absPhaseMap, bool filter)
+void phaseCalculator::unwrapMaps(const vector<Mat> &relPhaseMap, const Mat &refPhase, const Mat &mask, Mat &absPhaseMap, bool filter, Mat *confidence, const spanMask *spans)
 {
-    // Check if relPhaseMap have correct phase maps.
-    if (relPhaseMap.size() != 3)
+    // Allocate memory for absPhaseMap. Fixed-point phase is unwrapped in tiles of input type and encoded.
+    int type = relPhaseMap[0].type();
+    absPhaseMap.create(relPhaseMap[0].size(), phaseType == CV_16UC1 ? CV_16UC1 : type);
+    bool het3 = heterodyneSteps == THREE_STEP_HETERODYNE;
+    if (type == CV_64FC1)
+        het3 ? unwrapTiles<double, true>(relPhaseMap, refPhase, mask, absPhaseMap, filter, confidence, spans) : unwrapTiles<double, false>(relPhaseMap, refPhase, mask, absPhaseMap, filter, confidence, spans);
+    else
+        het3 ? unwrapTiles<float, true>(relPhaseMap, refPhase, mask, absPhaseMap, filter, confidence, spans) : unwrapTiles<float, false>(relPhaseMap, refPhase, mask, absPhaseMap, filter, confidence, spans);
+}
+
+void phaseCalculator::calAbsPhaseDirect(const vector<Mat> &stripImg, Mat &absPhaseMap, bool filter, phaseQuality *quality, const spanMask *mask)
+{
+    PMP_CALL(instrument);
+    // Check integrity of image set.
+    if ((int)stripImg.size() != freqNum * stepNum)
     {
-        cout << "The number of phase maps is wrong!" << endl;
+        cout << "Error image number!" << endl;
         throw exception();
     }
 
-    // Allocate memory for absPhaseMap.
-    absPhaseMap.create(relPhaseMap[0].size(), CV_TYPE);
+    // Allocate memory for absPhaseMap. Fixed-point phase is calculated in float.
+    checkMask(mask, stripImg[0].size());
+    absPhaseMap.create(stripImg[0].size(), phaseType);
+    createQuality(quality, absPhaseMap.size(), QUALITY_ALL);
+    if (phaseType == CV_64FC1)
+        calAbsPhaseDirectType<double>(stripImg, absPhaseMap, filter, quality, mask);
+    else
+        calAbsPhaseDirectType<float>(stripImg, absPhaseMap, filter, quality, mask);
+}
 
-// Calculate heterodyne phase and use it to unwrap relative phase.
-#pragma omp parallel for simd
-    for (int i = 0; i < absPhaseMap.rows; ++i)
+template <typename T>
+void phaseCalculator::calAbsPhaseDirectType(const vector<Mat> &stripImg, Mat &absPhaseMap, bool filter, phaseQuality *quality, const spanMask *mask)
+{
+    if (shiftSteps == N_STEP_SHIFT)
+        calAbsPhaseDirectShift<T, N_STEP_SHIFT>(stripImg, absPhaseMap, filter, quality, mask);
+    else if (shiftSteps == FOUR_STEP_SHIFT)
+        calAbsPhaseDirectShift<T, FOUR_STEP_SHIFT>(stripImg, absPhaseMap, filter, quality, mask);
+    else
+        calAbsPhaseDirectShift<T, THREE_STEP_SHIFT>(stripImg, absPhaseMap, filter, quality, mask);
+}
+
+template <typename T, int SHIFT>
+void phaseCalculator::calAbsPhaseDirectShift(const vector<Mat> &stripImg, Mat &absPhaseMap, bool filter, phaseQuality *quality, const spanMask *mask)
+{
+    if (heterodyneSteps == THREE_STEP_HETERODYNE)
+        calAbsPhaseTiles<T, SHIFT, true>(stripImg, absPhaseMap, filter, quality, mask);
+    else
+        calAbsPhaseTiles<T, SHIFT, false>(stripImg, absPhaseMap, filter, quality, mask);
+}
+
+template <typename T, int SHIFT, bool HET3>
+void phaseCalculator::calAbsPhaseTiles(const vector<Mat> &stripImg, Mat &absPhaseMap, bool filter, phaseQuality *quality, const spanMask *mask)
+{
+    int steps = stepNum;
+    int rows = stripImg[0].rows, cols = stripImg[0].cols;
+    int type = DataType<T>::type;
+    // Fixed-point phase is calculated in tiles of T and encoded.
+    bool fixed = absPhaseMap.type() == CV_16UC1;
+    bool tiled = filter || fixed;
+    // Rows above and below a tile needed by phase filter.
+    int halo = filter ? getFilterHalo() : 0;
+    int tileNum = (rows + PHASE_TILE_ROWS - 1) / PHASE_TILE_ROWS;
+    int tileRows = tiled ? PHASE_TILE_ROWS + 2 * halo : 0;
+    size_t filterElems = filter ? (size_t)tileRows * cols : 0;
+    scratchBuffer<T>::reserve(workspace, 0, freqNum * cols);
+    scratchBuffer<T>::reserve(workspace, 1, 2 * cols);
+    scratchBuffer<const uchar *>::reserve(workspace, 2, steps);
+    scratchBuffer<T>::reserve(workspace, 3, (size_t)tileRows * cols);
+    scratchBuffer<T>::reserve(workspace, 4, filterElems);
+    scratchBuffer<T>::reserve(workspace, 5, filterElems);
+
+#pragma omp parallel
     {
-        for (int j = 0; j < absPhaseMap.cols; ++j)
+        // Per-thread buffers. Relative phase only lives for one row.
+        scratchBuffer<T> relPhase(workspace, 0, freqNum * cols), buf(workspace, 1, 2 * cols);
+        scratchBuffer<const uchar *> I(workspace, 2, steps);
+        scratchBuffer<T> absBuf(workspace, 3, (size_t)tileRows * cols), correctedBuf(workspace, 4, filterElems), smoothedBuf(workspace, 5, filterElems);
+        Mat absTile, corrected, smoothed;
+        const T *phase[MAX_FREQ_NUM];
+        int whole[2] = {0, cols};
+#pragma omp for schedule(dynamic)
+        for (int t = 0; t < tileNum; ++t)
         {
-            TYPE phase123;
-            TYPE phase1 = relPhaseMap[0].at<TYPE>(i, j);
-            TYPE phase2 = relPhaseMap[1].at<TYPE>(i, j);
-            TYPE phase3 = relPhaseMap[2].at<TYPE>(i, j);
+            int r0 = t * PHASE_TILE_ROWS, r1 = min(r0 + PHASE_TILE_ROWS, rows);
+            // Rows to calculate, including filter halo.
+            int c0 = max(r0 - halo, 0), c1 = min(r1 + halo, rows);
 
-            if (isnan(phase1) | isnan(phase2) | isnan(phase3))
-                absPhaseMap.at<TYPE>(i, j) = NAN;
-            else
+            // Tiles out of mask are invalid without calculation.
+            bool skip = mask != NULL;
+            for (int i = c0; i < c1 && skip; ++i)
+                skip = mask->spanNum(i) == 0;
+            if (skip)
             {
-                if (heterodyneSteps == TWO_STEP_HETERODYNE)
+                for (int i = r0; i < r1; ++i)
                 {
-                    TYPE phase12, phase123, absPhase12;
-                    phase12 = heterodyne(phase1, phase2);
-                    phase123 = heterodyne(phase12, phase3);
-                    absPhase12 = phase12 + PI_2 * round((phase123 * ratio_3to2 - phase12) / PI_2);
-                    absPhaseMap.at<TYPE>(i, j) = phase1 + PI_2 * round((absPhase12 * ratio_2to1 - phase1) / PI_2);
+                    if (fixed)
+                        fill(absPhaseMap.ptr<ushort>(i), absPhaseMap.ptr<ushort>(i) + cols, (ushort)PHASE_INVALID);
+                    else
+                        fill(absPhaseMap.ptr<T>(i), absPhaseMap.ptr<T>(i) + cols, (T)NAN);
+                    for (int flag = QUALITY_MODULATION; flag <= QUALITY_CONFIDENCE; flag <<= 1)
+                        if (uchar *q = qualityRow(quality, flag, i))
+                            fill(q, q + cols, 0);
                 }
-                else
+                continue;
+            }
+
+            if (tiled)
+                absTile = Mat(c1 - c0, cols, type, absBuf.data());
+            if (filter)
+            {
+                corrected = Mat(c1 - c0, cols, type, correctedBuf.data());
+                smoothed = Mat(c1 - c0, cols, type, smoothedBuf.data());
+            }
+
+            for (int i = c0; i < c1; ++i)
+            {
+                bool own = i >= r0 && i < r1;
+                const int *spans;
+                int spanNum = maskSpans(mask, i, whole, spans);
+                T *dst = tiled ? absTile.ptr<T>(i - c0) : absPhaseMap.ptr<T>(i);
+                uchar *modulation = own ? qualityRow(quality, QUALITY_MODULATION, i) : NULL;
+                uchar *texture = own ? qualityRow(quality, QUALITY_TEXTURE, i) : NULL;
+                uchar *conf = own ? qualityRow(quality, QUALITY_CONFIDENCE, i) : NULL;
+                if (mask)
                 {
-                    TYPE absPhase13, phase13, phase23, phase123;
-                    phase13 = heterodyne(phase1, phase3);
-                    phase23 = heterodyne(phase2, phase3);
-                    phase123 = heterodyne(phase13, phase23);
-                    absPhase13 = phase13 + PI_2 * round((phase123 * ratio_3to2 - phase13) / PI_2);
-                    absPhaseMap.at<TYPE>(i, j) = phase1 + PI_2 * round((absPhase13 * ratio_2to1 - phase1) / PI_2);
+                    fillOutside(dst, cols, spans, spanNum, (T)NAN);
+                    for (uchar *q : {modulation, texture, conf})
+                        if (q)
+                            fillOutside(q, cols, spans, spanNum, (uchar)0);
                 }
+
+                for (int s = 0; s < spanNum; ++s)
+                {
+                    int b = spans[2 * s], w = spans[2 * s + 1] - b;
+                    {
+                        PMP_ROWS(instrument, STAGE_WRAP, s == 0);
+                        for (int k = 0; k < freqNum; ++k)
+                        {
+                            for (int n = 0; n < steps; ++n)
+                                I[n] = stripImg[k * steps + n].ptr<uchar>(i) + b;
+                            calRelPhaseRow<T, SHIFT>(I.data(), &relPhase[k * cols + b], buf.data(), w);
+                            // Quality of freq1 while its images and N-step sums are in cache.
+                            if (k == 0 && quality && own)
+                                calQualityRow<T, SHIFT>(I.data(), buf.data(), modulation ? modulation + b : NULL, texture ? texture + b : NULL, w);
+                        }
+                    }
+                    // Halo rows are calculated twice but counted once.
+                    if (own)
+                    {
+                        PMP_COUNT(instrument, COUNT_PHASE_PIXELS, freqNum * w);
+                        for (int k = 0; k < freqNum; ++k)
+                            PMP_COUNT(instrument, COUNT_LOW_MODULATION, countNaN(&relPhase[k * cols + b], w));
+                    }
+                    PMP_ROWS(instrument, STAGE_UNWRAP, s == 0);
+                    for (int k = 0; k < freqNum; ++k)
+                        phase[k] = &relPhase[k * cols + b];
+                    unwrapRow<T, HET3>(phase, dst + b, conf ? conf + b : NULL, w);
+                }
+            }
+
+            // Phase filter on the tile, back into its own rows. Halo rows make the result equal to filtering the full frame.
+            if (filter)
+            {
+                PMP_ROWS(instrument, STAGE_FILTER, r1 - r0);
+                Mat own = absTile.rowRange(r0 - c0, r1 - c0);
+                phaseFilter<T>(absTile, corrected, smoothed, r0 - c0, r1 - c0, own, filterSize, instrument);
+            }
+            const Mat &tile = absTile;
+            PMP_COUNT(instrument, COUNT_ABS_VALID, (long)(r1 - r0) * cols - (tiled ? countPhaseNaN(tile.rowRange(r0 - c0, r1 - c0)) : countPhaseNaN(absPhaseMap.rowRange(r0, r1))));
+            if (tiled)
+            {
+                if (fixed)
+                    for (int i = r0; i < r1; ++i)
+                        encodePhaseRow(tile.ptr<T>(i - c0), absPhaseMap.ptr<ushort>(i), cols, (T)fixedScale);
+                else
+                    tile.rowRange(r0 - c0, r1 - c0).copyTo(absPhaseMap.rowRange(r0, r1));
             }
         }
     }
-    if (filter)
-        medianBlur(absPhaseMap, absPhaseMap, PHASE_FILTER_WINSIZE);
-}
\ No newline at end of file
+}
@@ -4,11 +4,16 @@
 #include <iostream>
 #include <vector>
 #include "setting.h"
+#include "workspace.h"
+#include "instrument.h"
+#include "phaseFixed.h"
+#include "spanMask.h"
 
 // Struct to initialize phase calculator.
 struct pmpConfig
 {
-    bool shiftSteps; // N-Step algorithm.
+    int shiftSteps; // N-Step algorithm. THREE_STEP_SHIFT, FOUR_STEP_SHIFT or N_STEP_SHIFT.
+    int stepNum;    // Number of images per frequency for N_STEP_SHIFT.
     // Steps to calculate final hetero phase map.
     // 0 for 2-step method. phase1 phase2 -> phase12, phase12 phase3 -> phase123.
     // 1 for 3-step method. phase1 phase2 -> phase12, phase2 phase3 -> phase23, phase12 phase23 -> phase123.
@@ -16,8 +21,39 @@ struct pmpConfig
     // Degree of modulation threshold.
     TYPE BTH;
     TYPE freq1, freq2, freq3; // Strip frequency.
+    int phaseType;            // Type of phase maps. CV_32FC1, CV_64FC1, or CV_16UC1 for fixed-point absolute phase.
+    // Strip frequencies of N-frequency unwrapping, fine to coarse. Empty to use freq1, freq2 and freq3.
+    std::vector<TYPE> freqs;
+    // N-frequency unwrapping method.
+    // HETERODYNE_UNWRAP. Each frequency beats the previous beat phase. The last beat has at most one period.
+    // HIERARCHICAL_UNWRAP. Each frequency unwraps the next finer one. The last frequency has at most one period.
+    int unwrapMethod;
+    // Max fringe order residual of reliable pixels, in (0, 0.5]. Unreliable pixels are invalid, 0.5 keeps all.
+    // Used by N-frequency and guided unwrapping.
+    TYPE unwrapTH;
+    // Window of phase filter, odd up to PHASE_FILTER_MAXSIZE. PHASE_FILTER_WINSIZE by default.
+    // 1 only fixes fringe order errors.
+    int filterSize;
 
-    pmpConfig(TYPE freq1, TYPE freq2, TYPE freq3, TYPE B_th, bool shiftSteps, bool heterodyneSteps);
+    pmpConfig(TYPE freq1, TYPE freq2, TYPE freq3, TYPE B_th, int shiftSteps, bool heterodyneSteps, int stepNum = 0, int phaseType = CV_TYPE);
+    pmpConfig(const std::vector<TYPE> &freqs, TYPE B_th, int shiftSteps, int unwrapMethod, int stepNum = 0, int phaseType = CV_TYPE, TYPE unwrapTH = 0.5);
+};
+
+// Per-pixel quality maps, emitted by phase calculation in the same pass over strip images.
+// Maps are CV_8UC1 of the image size, filled if selected by flags.
+struct phaseQuality
+{
+    // QUALITY_MODULATION, QUALITY_TEXTURE and QUALITY_CONFIDENCE combined.
+    int flags;
+    // Modulation b of freq1 in gray levels, saturated at 255.
+    cv::Mat modulation;
+    // Mean intensity a of freq1 images.
+    cv::Mat texture;
+    // Unwrap confidence. 255 * (1 - 2 * r), r being the largest fringe order residual of unwrapping levels. 0 for invalid pixels.
+    // Taken before phase filter.
+    cv::Mat confidence;
+
+    phaseQuality(int flags = QUALITY_ALL);
 };
 
 // Calculator for phase calculation.
@@ -25,26 +61,106 @@ class phaseCalculator
 {
 protected:
     // Wave-length ratio.
-    TYPE ratio_3to2, ratio_2to1, ratio_3to1;
+    double ratio_3to2, ratio_2to1, ratio_3to1;
+    // Number of frequencies, 3 for freq1, freq2 and freq3.
+    int freqNum;
+    // Use N-frequency unwrapping.
+    bool multiFreq;
+    // N-frequency unwrapping method.
+    int unwrapMethod;
+    // Frequency ratio of unwrapping levels. Level k is unwrapped by level k + 1 scaled by unwrapRatio[k].
+    std::vector<double> unwrapRatio;
+    // Max fringe order residual of reliable pixels.
+    double unwrapTH;
+    // Window of phase filter.
+    int filterSize;
     // N-Step algorithm.
-    bool shiftSteps;
+    int shiftSteps;
+    // Number of images per frequency.
+    int stepNum;
+    // Weights of N-step algorithm. y = sum(I[n] * sinTable[n]), x = sum(I[n] * cosTable[n]).
+    std::vector<double> sinTable, cosTable;
     // Steps to calculate final heterodyne phase map.
     // 0 for 2-step method. phase1 phase2 -> phase12, phase12 phase3 -> phase123.
     // 1 for 3-step method. phase1 phase2 -> phase12, phase2 phase3 -> phase23, phase12 phase23 -> phase123.
     bool heterodyneSteps;
     // Degree of modulation threshold.
     TYPE BTH;
+    // Threshold of y^2 + x^2 equal to BTH, so that modulation is tested without sqrt.
+    double modTH2;
+    // Type of phase maps.
+    int phaseType;
+    // Codes per radian of fixed-point phase.
+    double fixedScale;
+    // Workspace of temporaries. NULL to allocate them per call.
+    pmpWorkspace *workspace;
+    // Stage timers and counters. NULL to disable.
+    pmpInstrument *instrument;
+
+    // Kernels are templated on element type T, shift algorithm SHIFT and heterodyne method HET3,
+    // so inner loops have no mode branch. Public methods dispatch once per call.
 
-    // Calculate relative phase according to phase shift steps.
-    void calRelPhase_3step(const std::vector<cv::Mat> &stripImg, cv::Mat &relPhaseMap);
-    void calRelPhase_4step(const std::vector<cv::Mat> &stripImg, cv::Mat &relPhaseMap);
+    // Row kernel of relative phase. I holds one row pointer per strip image.
+    // buf is scratch of 2 * cols elements, used by N-step algorithm.
+    template <typename T, int SHIFT>
+    void calRelPhaseRow(const uchar *const *I, T *dst, T *buf, int cols) const;
+    // Row kernel of modulation and texture, run right after calRelPhaseRow on the same images and buf.
+    // Null outputs are skipped.
+    template <typename T, int SHIFT>
+    void calQualityRow(const uchar *const *I, const T *buf, uchar *modulation, uchar *texture, int cols) const;
+    // Row kernel of squared modulation y^2 + x^2 of calRelPhaseRow, without the phase. buf is as in calRelPhaseRow.
+    template <typename T, int SHIFT>
+    void calModulationRow(const uchar *const *I, T *mod2, T *buf, int cols) const;
+    // N-step y and x of a row into buf, y in [0, cols) and x in [cols, 2 * cols).
+    template <typename T>
+    void accumulateRow(const uchar *const *I, T *buf, int cols) const;
+    // Row kernel of absolute phase. HET3 selects 3-step heterodyne method. CONF writes unwrap confidence to conf.
+    template <typename T, bool HET3, bool CONF>
+    void calAbsPhaseRow(const T *phase1, const T *phase2, const T *phase3, T *dst, uchar *conf, int cols) const;
+    // Row kernel of N-frequency unwrapping, down to level stop. HET selects heterodyne method. conf may be null.
+    template <typename T, bool HET>
+    void calAbsPhaseRowN(const T *const *phase, T *dst, uchar *conf, int cols, int stop) const;
+    // Unwrap a row. phase holds one row pointer per frequency. conf may be null.
+    template <typename T, bool HET3>
+    void unwrapRow(const T *const *phase, T *dst, uchar *conf, int cols) const;
+    // Row kernel of guided unwrapping. With phaseNum of freqNum, missed pixels are unwrapped with all frequencies.
+    template <typename T, bool HET3>
+    void calGuidedRow(const T *const *phase, int phaseNum, const T *ref, const uchar *mask, T *dst, int cols) const;
 
-    // Calcuate heterodyne phase.
-    TYPE calHeterodynePhase_2step(const TYPE &phase1, const TYPE &phase2, const TYPE &phase3) const;
-    TYPE calHeterodynePhase_3step(const TYPE &phase1, const TYPE &phase2, const TYPE &phase3) const;
+    // Calcuate heterodyne phase, the unwrapped phase of phase12 or phase13. residual is the fringe order residual.
+    template <typename T>
+    T calHeterodynePhase_2step(T phase1, T phase2, T phase3, T &residual) const;
+    template <typename T>
+    T calHeterodynePhase_3step(T phase1, T phase2, T phase3, T &residual) const;
 
     // Calculate heterodyne phase.
-    TYPE heterodyne(const TYPE &phase1, const TYPE &phase2) const;
+    template <typename T>
+    static T heterodyne(T phase1, T phase2);
+
+    // Map workers of public methods.
+    template <typename T>
+    void calRelPhaseType(const std::vector<cv::Mat> &stripImg, cv::Mat &relPhaseMap, phaseQuality *quality, const spanMask *mask);
+    template <typename T, int SHIFT>
+    void calRelPhaseMap(const std::vector<cv::Mat> &stripImg, cv::Mat &relPhaseMap, phaseQuality *quality, const spanMask *mask);
+    template <typename T, int SHIFT>
+    void calMaskMap(const std::vector<cv::Mat> &stripImg, std::vector<std::vector<int>> &rowSpans);
+    template <typename T, bool HET3>
+    void calHeterodyneMap(const std::vector<cv::Mat> &relPhaseMap, cv::Mat &hetetodynePhaseMap);
+    // Unwrap row i of relative phase maps into dst. refBuf holds a decoded row of fixed-point refPhase.
+    template <typename T, bool HET3>
+    void unwrapMapRow(const std::vector<cv::Mat> &relPhaseMap, const cv::Mat &refPhase, const cv::Mat &mask, int i, T *dst, uchar *conf, const spanMask *spans, T *refBuf);
+    // Unwrap in row tiles with filter halo. Tiles are filtered and encoded while in cache.
+    template <typename T, bool HET3>
+    void unwrapTiles(const std::vector<cv::Mat> &relPhaseMap, const cv::Mat &refPhase, const cv::Mat &mask, cv::Mat &absPhaseMap, bool filter, cv::Mat *confidence, const spanMask *spans);
+    // Unwrap, filter and encode. Guided if refPhase is not empty.
+    // confidence is filled if not null. spans limits unwrapping of non-guided maps.
+    void unwrapMaps(const std::vector<cv::Mat> &relPhaseMap, const cv::Mat &refPhase, const cv::Mat &mask, cv::Mat &absPhaseMap, bool filter, cv::Mat *confidence, const spanMask *spans);
+    template <typename T>
+    void calAbsPhaseDirectType(const std::vector<cv::Mat> &stripImg, cv::Mat &absPhaseMap, bool filter, phaseQuality *quality, const spanMask *mask);
+    template <typename T, int SHIFT>
+    void calAbsPhaseDirectShift(const std::vector<cv::Mat> &stripImg, cv::Mat &absPhaseMap, bool filter, phaseQuality *quality, const spanMask *mask);
+    template <typename T, int SHIFT, bool HET3>
+    void calAbsPhaseTiles(const std::vector<cv::Mat> &stripImg, cv::Mat &absPhaseMap, bool filter, phaseQuality *quality, const spanMask *mask);
 
 public:
     // Constructor.
@@ -54,14 +170,46 @@ public:
 
     // Update pmp algorithm parameters.
     void updateConfig(const pmpConfig &cfg);
+    // Draw temporaries from ws. NULL to allocate them per call.
+    void setWorkspace(pmpWorkspace *ws);
+    // Workspace set by setWorkspace, NULL if none.
+    pmpWorkspace *getWorkspace() const;
+    // Record stage timers and counters to ins. NULL to disable.
+    void setInstrument(pmpInstrument *ins);
+    // Instrument set by setInstrument, NULL if none.
+    pmpInstrument *getInstrument() const;
+    // Codes per radian of fixed-point absolute phase. Fixed-point covers [-pi, 2 * pi * (freq1 + 1) - pi).
+    double getFixedScale() const;
+    // Type of absolute phase maps.
+    int getPhaseType() const;
+    // Rows above and below a band read by phase filter, so that filtered rows of the band equal those of the full frame.
+    int getFilterHalo() const;
 
-    // Calculate relative phase map.
-    void calRelPhase(const std::vector<cv::Mat> &stripImg, cv::Mat &relPhaseMap);
-    // Calculate heterodyne phase map.
+    // Phase maps are of pmpConfig::phaseType. Input phase maps may be CV_32FC1 or CV_64FC1.
+    // With CV_16UC1, absolute phase is fixed-point and relative and heterodyne phase are CV_32FC1.
+    // Quality maps are optional. quality is null to skip them.
+    // mask limits work to its spans, pixels out of it are invalid and of quality 0. Null for all pixels.
+    // Calculate relative phase map. Fills modulation and texture of stripImg.
+    void calRelPhase(const std::vector<cv::Mat> &stripImg, cv::Mat &relPhaseMap, phaseQuality *quality = NULL, const spanMask *mask = NULL);
+    // Calculate heterodyne phase map. With N frequencies, the absolute phase of the level unwrapping freqs[0].
     void calHeterodynePhase(const std::vector<cv::Mat> &relPhaseMap, cv::Mat &hetetodynePhaseMap);
 
-    // Calculate absolute phase map.
-    void calAbsPhase(const std::vector<cv::Mat> &relPhaseMap, cv::Mat &absPhaseMap, bool filter = true);
+    // Calculate absolute phase map. Fills confidence.
+    void calAbsPhase(const std::vector<cv::Mat> &relPhaseMap, cv::Mat &absPhaseMap, bool filter = true, phaseQuality *quality = NULL, const spanMask *mask = NULL);
+    // Calculate absolute phase map directly from strip images of all frequencies.
+    // stripImg holds the images of freq1, freq2 and freq3, or of freqs, in order, one N-step set each.
+    // Work is done in row tiles so relative phase never leaves cache. Fills all quality maps, modulation and texture of freq1.
+    // Tiles without any span are skipped, tiles with spans are filtered as a whole.
+    void calAbsPhaseDirect(const std::vector<cv::Mat> &stripImg, cv::Mat &absPhaseMap, bool filter = true, phaseQuality *quality = NULL, const spanMask *mask = NULL);
+    // Automatic mask of pixels whose freq1 modulation passes BTH. stripImg holds the images of freq1 first, as calAbsPhaseDirect takes them.
+    // Only freq1 images are read.
+    void calMask(const std::vector<cv::Mat> &stripImg, spanMask &mask);
+    // Reliability-guided unwrapping of static regions. Pixels in mask take fringe orders from refPhase,
+    // the absolute phase of an earlier frame, so only the first relative phase map is used.
+    // Pixels out of mask or off refPhase by more than unwrapTH fringe are unwrapped with all frequencies
+    // if relPhaseMap holds them, or are invalid if it holds the first map only.
+    // mask is CV_8UC1, empty for all pixels. refPhase is of phaseType.
+    void calAbsPhaseGuided(const std::vector<cv::Mat> &relPhaseMap, const cv::Mat &refPhase, const cv::Mat &mask, cv::Mat &absPhaseMap, bool filter = true);
 };
 
 #endif
\ No newline at end of file
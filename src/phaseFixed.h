@@ -0,0 +1,30 @@
+#ifndef PHASE_FIXED
+#define PHASE_FIXED
+
+#include "setting.h"
+
+// 16-bit fixed-point phase, stored in CV_16UC1 maps.
+// code = round((phase + PHASE_FIXED_OFFSET) * scale), PHASE_INVALID for invalid pixels.
+
+// Encode a row of phase. NaN and phase out of range become PHASE_INVALID.
+template <typename T>
+inline void encodePhaseRow(const T *src, ushort *dst, int cols, T scale)
+{
+    for (int j = 0; j < cols; ++j)
+    {
+        T v = (src[j] + (T)PHASE_FIXED_OFFSET) * scale + (T)0.5;
+        // NaN fails both comparisons.
+        dst[j] = (v >= 0 && v < PHASE_INVALID) ? (ushort)v : PHASE_INVALID;
+    }
+}
+
+// Decode a row of phase. PHASE_INVALID becomes NaN.
+template <typename T>
+inline void decodePhaseRow(const ushort *src, T *dst, int cols, T scale)
+{
+    T inv = 1 / scale;
+    for (int j = 0; j < cols; ++j)
+        dst[j] = (src[j] == PHASE_INVALID) ? (T)NAN : src[j] * inv - (T)PHASE_FIXED_OFFSET;
+}
+
+#endif
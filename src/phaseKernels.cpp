@@ -0,0 +1,522 @@
+#include "phaseKernels.h"
+#include <cmath>
+#include <cstring>
+#include <atomic>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PHASE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+typedef unsigned char uchar;
+
+namespace phaseKernels
+{
+    // Constants of atan2. Range is reduced to [0, tan(pi/8)], then the cephes atanf polynomial is used.
+    static const float TAN_PI_8 = 0.41421356f;
+    static const float QUARTER_PI = 0.78539816f;
+    static const float HALF_PI = 1.57079633f;
+    static const float ONE_PI = 3.14159265f;
+    static const float C0 = 8.05374449538e-2f;
+    static const float C1 = -1.38776856032e-1f;
+    static const float C2 = 1.99777106478e-1f;
+    static const float C3 = -3.33329491539e-1f;
+    // Lower bound of denominator, keeps atan2(0, 0) = 0.
+    static const float TINY = 1e-30f;
+    static const float ROOT_3 = 1.73205081f;
+
+    float atan2Approx(float y, float x)
+    {
+        float ax = std::fabs(x), ay = std::fabs(y);
+        float mx = ax > ay ? ax : ay, mn = ax > ay ? ay : ax;
+        bool big = mn > TAN_PI_8 * mx;
+        float num = big ? mn - mx : mn;
+        float den = big ? mn + mx : mx;
+        den = den < TINY ? TINY : den;
+        float z = num / den, z2 = z * z;
+        float r = (((C0 * z2 + C1) * z2 + C2) * z2 + C3) * z2 * z + z;
+        if (big)
+            r += QUARTER_PI;
+        if (ay > ax)
+            r = HALF_PI - r;
+        if (std::signbit(x))
+            r = ONE_PI - r;
+        return std::signbit(y) ? -r : r;
+    }
+
+    // Scalar kernels, also used for the tail of vector kernels.
+    static inline float finish(float y, float x, float modTH2)
+    {
+        return (y * y + x * x < modTH2) ? NAN : atan2Approx(y, x);
+    }
+
+    static void relPhase3Scalar(const uchar *I1, const uchar *I2, const uchar *I3, float *dst, int begin, int n, float modTH2)
+    {
+        for (int j = begin; j < n; ++j)
+            dst[j] = finish(ROOT_3 * (I1[j] - I2[j]), 2.0f * I2[j] - I1[j] - I3[j], modTH2);
+    }
+
+    static void relPhase4Scalar(const uchar *I1, const uchar *I2, const uchar *I3, const uchar *I4, float *dst, int begin, int n, float modTH2)
+    {
+        for (int j = begin; j < n; ++j)
+            dst[j] = finish((float)(I4[j] - I2[j]), (float)(I1[j] - I3[j]), modTH2);
+    }
+
+    static void wrapPhaseScalar(const float *y, const float *x, float *dst, int begin, int n, float modTH2)
+    {
+        for (int j = begin; j < n; ++j)
+            dst[j] = finish(y[j], x[j], modTH2);
+    }
+
+    static void smoothPhaseScalar(const float *center, const float *const *taps, int pairNum, float *dst, int begin, int n, float th)
+    {
+        for (int j = begin; j < n; ++j)
+        {
+            float c = center[j], sum = c, cnt = 1, s = 0, line = 0;
+            // Slope of the flatter side of the nearest pair. NaN or over pi counts as flat.
+            if (pairNum)
+            {
+                float a = taps[0][j], b = taps[1][j];
+                s = (std::fabs(c - a) < std::fabs(b - c)) ? c - a : b - c;
+                s = (std::fabs(s) < ONE_PI) ? s : 0;
+            }
+            for (int k = 0; k < pairNum; ++k)
+            {
+                float a = taps[2 * k][j], b = taps[2 * k + 1][j];
+                line += s;
+                // NaN compares false, so pairs with an invalid tap are skipped. NaN center stays NaN.
+                bool ok = (std::fabs(a - c + line) < th) & (std::fabs(b - c - line) < th);
+                sum += ok ? a + b : 0;
+                cnt += ok ? 2 : 0;
+            }
+            dst[j] = sum / cnt;
+        }
+    }
+
+    static void relPhase3Scalar(const uchar *I1, const uchar *I2, const uchar *I3, float *dst, int n, float modTH2)
+    {
+        relPhase3Scalar(I1, I2, I3, dst, 0, n, modTH2);
+    }
+
+    static void relPhase4Scalar(const uchar *I1, const uchar *I2, const uchar *I3, const uchar *I4, float *dst, int n, float modTH2)
+    {
+        relPhase4Scalar(I1, I2, I3, I4, dst, 0, n, modTH2);
+    }
+
+    static void wrapPhaseScalar(const float *y, const float *x, float *dst, int n, float modTH2)
+    {
+        wrapPhaseScalar(y, x, dst, 0, n, modTH2);
+    }
+
+    static void smoothPhaseScalar(const float *center, const float *const *taps, int pairNum, float *dst, int n, float th)
+    {
+        smoothPhaseScalar(center, taps, pairNum, dst, 0, n, th);
+    }
+
+#ifdef PHASE_KERNELS_X86
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+    namespace sse4
+    {
+        static inline __m128 load(const uchar *p)
+        {
+            int v;
+            memcpy(&v, p, sizeof(v));
+            return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+        }
+
+        static inline __m128 atan2v(__m128 y, __m128 x)
+        {
+            const __m128 sign = _mm_set1_ps(-0.0f);
+            __m128 ax = _mm_andnot_ps(sign, x), ay = _mm_andnot_ps(sign, y);
+            __m128 mx = _mm_max_ps(ax, ay), mn = _mm_min_ps(ax, ay);
+            __m128 big = _mm_cmpgt_ps(mn, _mm_mul_ps(_mm_set1_ps(TAN_PI_8), mx));
+            __m128 num = _mm_blendv_ps(mn, _mm_sub_ps(mn, mx), big);
+            __m128 den = _mm_max_ps(_mm_blendv_ps(mx, _mm_add_ps(mn, mx), big), _mm_set1_ps(TINY));
+            __m128 z = _mm_div_ps(num, den), z2 = _mm_mul_ps(z, z);
+            __m128 r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(C0), z2), _mm_set1_ps(C1));
+            r = _mm_add_ps(_mm_mul_ps(r, z2), _mm_set1_ps(C2));
+            r = _mm_add_ps(_mm_mul_ps(r, z2), _mm_set1_ps(C3));
+            r = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(r, z2), z), z);
+            r = _mm_add_ps(r, _mm_and_ps(big, _mm_set1_ps(QUARTER_PI)));
+            r = _mm_blendv_ps(r, _mm_sub_ps(_mm_set1_ps(HALF_PI), r), _mm_cmpgt_ps(ay, ax));
+            // blendv selects by sign bit, so x and y serve as masks directly.
+            r = _mm_blendv_ps(r, _mm_sub_ps(_mm_set1_ps(ONE_PI), r), x);
+            return _mm_xor_ps(r, _mm_and_ps(sign, y));
+        }
+
+        static inline __m128 finish(__m128 y, __m128 x, __m128 th)
+        {
+            __m128 m = _mm_add_ps(_mm_mul_ps(y, y), _mm_mul_ps(x, x));
+            return _mm_blendv_ps(atan2v(y, x), _mm_set1_ps(NAN), _mm_cmplt_ps(m, th));
+        }
+
+        static void relPhase3(const uchar *I1, const uchar *I2, const uchar *I3, float *dst, int n, float modTH2)
+        {
+            const __m128 r3 = _mm_set1_ps(ROOT_3), two = _mm_set1_ps(2.0f), th = _mm_set1_ps(modTH2);
+            int j = 0;
+            for (; j + 4 <= n; j += 4)
+            {
+                __m128 a = load(I1 + j), b = load(I2 + j), c = load(I3 + j);
+                __m128 y = _mm_mul_ps(r3, _mm_sub_ps(a, b));
+                __m128 x = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(two, b), a), c);
+                _mm_storeu_ps(dst + j, finish(y, x, th));
+            }
+            relPhase3Scalar(I1, I2, I3, dst, j, n, modTH2);
+        }
+
+        static void relPhase4(const uchar *I1, const uchar *I2, const uchar *I3, const uchar *I4, float *dst, int n, float modTH2)
+        {
+            const __m128 th = _mm_set1_ps(modTH2);
+            int j = 0;
+            for (; j + 4 <= n; j += 4)
+            {
+                __m128 y = _mm_sub_ps(load(I4 + j), load(I2 + j));
+                __m128 x = _mm_sub_ps(load(I1 + j), load(I3 + j));
+                _mm_storeu_ps(dst + j, finish(y, x, th));
+            }
+            relPhase4Scalar(I1, I2, I3, I4, dst, j, n, modTH2);
+        }
+
+        static void wrapPhase(const float *y, const float *x, float *dst, int n, float modTH2)
+        {
+            const __m128 th = _mm_set1_ps(modTH2);
+            int j = 0;
+            for (; j + 4 <= n; j += 4)
+                _mm_storeu_ps(dst + j, finish(_mm_loadu_ps(y + j), _mm_loadu_ps(x + j), th));
+            wrapPhaseScalar(y, x, dst, j, n, modTH2);
+        }
+
+        static void smoothPhase(const float *center, const float *const *taps, int pairNum, float *dst, int n, float th)
+        {
+            const __m128 sign = _mm_set1_ps(-0.0f), pi = _mm_set1_ps(ONE_PI), t = _mm_set1_ps(th), two = _mm_set1_ps(2.0f);
+            int j = 0;
+            for (; j + 4 <= n; j += 4)
+            {
+                __m128 c = _mm_loadu_ps(center + j), sum = c, cnt = _mm_set1_ps(1.0f), s = _mm_setzero_ps(), line = s;
+                if (pairNum)
+                {
+                    __m128 da = _mm_sub_ps(c, _mm_loadu_ps(taps[0] + j)), db = _mm_sub_ps(_mm_loadu_ps(taps[1] + j), c);
+                    s = _mm_blendv_ps(db, da, _mm_cmplt_ps(_mm_andnot_ps(sign, da), _mm_andnot_ps(sign, db)));
+                    s = _mm_and_ps(s, _mm_cmplt_ps(_mm_andnot_ps(sign, s), pi));
+                }
+                for (int k = 0; k < pairNum; ++k)
+                {
+                    __m128 a = _mm_loadu_ps(taps[2 * k] + j), b = _mm_loadu_ps(taps[2 * k + 1] + j);
+                    line = _mm_add_ps(line, s);
+                    __m128 ok = _mm_and_ps(_mm_cmplt_ps(_mm_andnot_ps(sign, _mm_add_ps(_mm_sub_ps(a, c), line)), t),
+                                           _mm_cmplt_ps(_mm_andnot_ps(sign, _mm_sub_ps(_mm_sub_ps(b, c), line)), t));
+                    sum = _mm_add_ps(sum, _mm_and_ps(ok, _mm_add_ps(a, b)));
+                    cnt = _mm_add_ps(cnt, _mm_and_ps(ok, two));
+                }
+                _mm_storeu_ps(dst + j, _mm_div_ps(sum, cnt));
+            }
+            smoothPhaseScalar(center, taps, pairNum, dst, j, n, th);
+        }
+    }
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+    namespace avx2
+    {
+        static inline __m256 load(const uchar *p)
+        {
+            return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p)));
+        }
+
+        static inline __m256 atan2v(__m256 y, __m256 x)
+        {
+            const __m256 sign = _mm256_set1_ps(-0.0f);
+            __m256 ax = _mm256_andnot_ps(sign, x), ay = _mm256_andnot_ps(sign, y);
+            __m256 mx = _mm256_max_ps(ax, ay), mn = _mm256_min_ps(ax, ay);
+            __m256 big = _mm256_cmp_ps(mn, _mm256_mul_ps(_mm256_set1_ps(TAN_PI_8), mx), _CMP_GT_OQ);
+            __m256 num = _mm256_blendv_ps(mn, _mm256_sub_ps(mn, mx), big);
+            __m256 den = _mm256_max_ps(_mm256_blendv_ps(mx, _mm256_add_ps(mn, mx), big), _mm256_set1_ps(TINY));
+            __m256 z = _mm256_div_ps(num, den), z2 = _mm256_mul_ps(z, z);
+            __m256 r = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(C0), z2), _mm256_set1_ps(C1));
+            r = _mm256_add_ps(_mm256_mul_ps(r, z2), _mm256_set1_ps(C2));
+            r = _mm256_add_ps(_mm256_mul_ps(r, z2), _mm256_set1_ps(C3));
+            r = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(r, z2), z), z);
+            r = _mm256_add_ps(r, _mm256_and_ps(big, _mm256_set1_ps(QUARTER_PI)));
+            r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(HALF_PI), r), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+            r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(ONE_PI), r), x);
+            return _mm256_xor_ps(r, _mm256_and_ps(sign, y));
+        }
+
+        static inline __m256 finish(__m256 y, __m256 x, __m256 th)
+        {
+            __m256 m = _mm256_add_ps(_mm256_mul_ps(y, y), _mm256_mul_ps(x, x));
+            return _mm256_blendv_ps(atan2v(y, x), _mm256_set1_ps(NAN), _mm256_cmp_ps(m, th, _CMP_LT_OQ));
+        }
+
+        static void relPhase3(const uchar *I1, const uchar *I2, const uchar *I3, float *dst, int n, float modTH2)
+        {
+            const __m256 r3 = _mm256_set1_ps(ROOT_3), two = _mm256_set1_ps(2.0f), th = _mm256_set1_ps(modTH2);
+            int j = 0;
+            for (; j + 8 <= n; j += 8)
+            {
+                __m256 a = load(I1 + j), b = load(I2 + j), c = load(I3 + j);
+                __m256 y = _mm256_mul_ps(r3, _mm256_sub_ps(a, b));
+                __m256 x = _mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(two, b), a), c);
+                _mm256_storeu_ps(dst + j, finish(y, x, th));
+            }
+            relPhase3Scalar(I1, I2, I3, dst, j, n, modTH2);
+        }
+
+        static void relPhase4(const uchar *I1, const uchar *I2, const uchar *I3, const uchar *I4, float *dst, int n, float modTH2)
+        {
+            const __m256 th = _mm256_set1_ps(modTH2);
+            int j = 0;
+            for (; j + 8 <= n; j += 8)
+            {
+                __m256 y = _mm256_sub_ps(load(I4 + j), load(I2 + j));
+                __m256 x = _mm256_sub_ps(load(I1 + j), load(I3 + j));
+                _mm256_storeu_ps(dst + j, finish(y, x, th));
+            }
+            relPhase4Scalar(I1, I2, I3, I4, dst, j, n, modTH2);
+        }
+
+        static void wrapPhase(const float *y, const float *x, float *dst, int n, float modTH2)
+        {
+            const __m256 th = _mm256_set1_ps(modTH2);
+            int j = 0;
+            for (; j + 8 <= n; j += 8)
+                _mm256_storeu_ps(dst + j, finish(_mm256_loadu_ps(y + j), _mm256_loadu_ps(x + j), th));
+            wrapPhaseScalar(y, x, dst, j, n, modTH2);
+        }
+
+        static void smoothPhase(const float *center, const float *const *taps, int pairNum, float *dst, int n, float th)
+        {
+            const __m256 sign = _mm256_set1_ps(-0.0f), pi = _mm256_set1_ps(ONE_PI), t = _mm256_set1_ps(th), two = _mm256_set1_ps(2.0f);
+            int j = 0;
+            for (; j + 8 <= n; j += 8)
+            {
+                __m256 c = _mm256_loadu_ps(center + j), sum = c, cnt = _mm256_set1_ps(1.0f), s = _mm256_setzero_ps(), line = s;
+                if (pairNum)
+                {
+                    __m256 da = _mm256_sub_ps(c, _mm256_loadu_ps(taps[0] + j)), db = _mm256_sub_ps(_mm256_loadu_ps(taps[1] + j), c);
+                    s = _mm256_blendv_ps(db, da, _mm256_cmp_ps(_mm256_andnot_ps(sign, da), _mm256_andnot_ps(sign, db), _CMP_LT_OQ));
+                    s = _mm256_and_ps(s, _mm256_cmp_ps(_mm256_andnot_ps(sign, s), pi, _CMP_LT_OQ));
+                }
+                for (int k = 0; k < pairNum; ++k)
+                {
+                    __m256 a = _mm256_loadu_ps(taps[2 * k] + j), b = _mm256_loadu_ps(taps[2 * k + 1] + j);
+                    line = _mm256_add_ps(line, s);
+                    __m256 ok = _mm256_and_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, _mm256_add_ps(_mm256_sub_ps(a, c), line)), t, _CMP_LT_OQ),
+                                              _mm256_cmp_ps(_mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_sub_ps(b, c), line)), t, _CMP_LT_OQ));
+                    sum = _mm256_add_ps(sum, _mm256_and_ps(ok, _mm256_add_ps(a, b)));
+                    cnt = _mm256_add_ps(cnt, _mm256_and_ps(ok, two));
+                }
+                _mm256_storeu_ps(dst + j, _mm256_div_ps(sum, cnt));
+            }
+            smoothPhaseScalar(center, taps, pairNum, dst, j, n, th);
+        }
+    }
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+    namespace avx512
+    {
+        static inline __m512 load(const uchar *p)
+        {
+            return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)p)));
+        }
+
+        static inline __mmask16 negative(__m512 v)
+        {
+            return _mm512_cmplt_epi32_mask(_mm512_castps_si512(v), _mm512_setzero_si512());
+        }
+
+        static inline __m512 atan2v(__m512 y, __m512 x)
+        {
+            const __m512i sign = _mm512_set1_epi32(0x80000000);
+            __m512 ax = _mm512_castsi512_ps(_mm512_andnot_si512(sign, _mm512_castps_si512(x)));
+            __m512 ay = _mm512_castsi512_ps(_mm512_andnot_si512(sign, _mm512_castps_si512(y)));
+            __m512 mx = _mm512_max_ps(ax, ay), mn = _mm512_min_ps(ax, ay);
+            __mmask16 big = _mm512_cmp_ps_mask(mn, _mm512_mul_ps(_mm512_set1_ps(TAN_PI_8), mx), _CMP_GT_OQ);
+            __m512 num = _mm512_mask_blend_ps(big, mn, _mm512_sub_ps(mn, mx));
+            __m512 den = _mm512_max_ps(_mm512_mask_blend_ps(big, mx, _mm512_add_ps(mn, mx)), _mm512_set1_ps(TINY));
+            __m512 z = _mm512_div_ps(num, den), z2 = _mm512_mul_ps(z, z);
+            __m512 r = _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(C0), z2), _mm512_set1_ps(C1));
+            r = _mm512_add_ps(_mm512_mul_ps(r, z2), _mm512_set1_ps(C2));
+            r = _mm512_add_ps(_mm512_mul_ps(r, z2), _mm512_set1_ps(C3));
+            r = _mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(r, z2), z), z);
+            r = _mm512_mask_add_ps(r, big, r, _mm512_set1_ps(QUARTER_PI));
+            r = _mm512_mask_sub_ps(r, _mm512_cmp_ps_mask(ay, ax, _CMP_GT_OQ), _mm512_set1_ps(HALF_PI), r);
+            r = _mm512_mask_sub_ps(r, negative(x), _mm512_set1_ps(ONE_PI), r);
+            return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(r), _mm512_and_si512(sign, _mm512_castps_si512(y))));
+        }
+
+        static inline __m512 finish(__m512 y, __m512 x, __m512 th)
+        {
+            __m512 m = _mm512_add_ps(_mm512_mul_ps(y, y), _mm512_mul_ps(x, x));
+            return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(m, th, _CMP_LT_OQ), atan2v(y, x), _mm512_set1_ps(NAN));
+        }
+
+        static void relPhase3(const uchar *I1, const uchar *I2, const uchar *I3, float *dst, int n, float modTH2)
+        {
+            const __m512 r3 = _mm512_set1_ps(ROOT_3), two = _mm512_set1_ps(2.0f), th = _mm512_set1_ps(modTH2);
+            int j = 0;
+            for (; j + 16 <= n; j += 16)
+            {
+                __m512 a = load(I1 + j), b = load(I2 + j), c = load(I3 + j);
+                __m512 y = _mm512_mul_ps(r3, _mm512_sub_ps(a, b));
+                __m512 x = _mm512_sub_ps(_mm512_sub_ps(_mm512_mul_ps(two, b), a), c);
+                _mm512_storeu_ps(dst + j, finish(y, x, th));
+            }
+            relPhase3Scalar(I1, I2, I3, dst, j, n, modTH2);
+        }
+
+        static void relPhase4(const uchar *I1, const uchar *I2, const uchar *I3, const uchar *I4, float *dst, int n, float modTH2)
+        {
+            const __m512 th = _mm512_set1_ps(modTH2);
+            int j = 0;
+            for (; j + 16 <= n; j += 16)
+            {
+                __m512 y = _mm512_sub_ps(load(I4 + j), load(I2 + j));
+                __m512 x = _mm512_sub_ps(load(I1 + j), load(I3 + j));
+                _mm512_storeu_ps(dst + j, finish(y, x, th));
+            }
+            relPhase4Scalar(I1, I2, I3, I4, dst, j, n, modTH2);
+        }
+
+        static void wrapPhase(const float *y, const float *x, float *dst, int n, float modTH2)
+        {
+            const __m512 th = _mm512_set1_ps(modTH2);
+            int j = 0;
+            for (; j + 16 <= n; j += 16)
+                _mm512_storeu_ps(dst + j, finish(_mm512_loadu_ps(y + j), _mm512_loadu_ps(x + j), th));
+            wrapPhaseScalar(y, x, dst, j, n, modTH2);
+        }
+
+        static void smoothPhase(const float *center, const float *const *taps, int pairNum, float *dst, int n, float th)
+        {
+            const __m512 pi = _mm512_set1_ps(ONE_PI), t = _mm512_set1_ps(th), two = _mm512_set1_ps(2.0f);
+            int j = 0;
+            for (; j + 16 <= n; j += 16)
+            {
+                __m512 c = _mm512_loadu_ps(center + j), sum = c, cnt = _mm512_set1_ps(1.0f), s = _mm512_setzero_ps(), line = s;
+                if (pairNum)
+                {
+                    __m512 da = _mm512_sub_ps(c, _mm512_loadu_ps(taps[0] + j)), db = _mm512_sub_ps(_mm512_loadu_ps(taps[1] + j), c);
+                    s = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(_mm512_abs_ps(da), _mm512_abs_ps(db), _CMP_LT_OQ), db, da);
+                    s = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(_mm512_abs_ps(s), pi, _CMP_LT_OQ), s);
+                }
+                for (int k = 0; k < pairNum; ++k)
+                {
+                    __m512 a = _mm512_loadu_ps(taps[2 * k] + j), b = _mm512_loadu_ps(taps[2 * k + 1] + j);
+                    line = _mm512_add_ps(line, s);
+                    __mmask16 ok = _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_add_ps(_mm512_sub_ps(a, c), line)), t, _CMP_LT_OQ) &
+                                   _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(_mm512_sub_ps(b, c), line)), t, _CMP_LT_OQ);
+                    sum = _mm512_mask_add_ps(sum, ok, sum, _mm512_add_ps(a, b));
+                    cnt = _mm512_mask_add_ps(cnt, ok, cnt, two);
+                }
+                _mm512_storeu_ps(dst + j, _mm512_div_ps(sum, cnt));
+            }
+            smoothPhaseScalar(center, taps, pairNum, dst, j, n, th);
+        }
+    }
+#pragma GCC pop_options
+#endif
+
+    int detectIsa()
+    {
+#ifdef PHASE_KERNELS_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return ISA_AVX512;
+        if (__builtin_cpu_supports("avx2"))
+            return ISA_AVX2;
+        if (__builtin_cpu_supports("sse4.1"))
+            return ISA_SSE4;
+#endif
+        return ISA_SCALAR;
+    }
+
+    static std::atomic<int> &currentIsa()
+    {
+        static std::atomic<int> isa(detectIsa());
+        return isa;
+    }
+
+    int getIsa()
+    {
+        return currentIsa();
+    }
+
+    void setIsa(int isa)
+    {
+        int best = detectIsa();
+        currentIsa() = (isa < ISA_SCALAR) ? ISA_SCALAR : (isa > best ? best : isa);
+    }
+
+    void relPhase3(const uchar *I1, const uchar *I2, const uchar *I3, float *dst, int n, float modTH2)
+    {
+        switch (getIsa())
+        {
+#ifdef PHASE_KERNELS_X86
+        case ISA_AVX512:
+            return avx512::relPhase3(I1, I2, I3, dst, n, modTH2);
+        case ISA_AVX2:
+            return avx2::relPhase3(I1, I2, I3, dst, n, modTH2);
+        case ISA_SSE4:
+            return sse4::relPhase3(I1, I2, I3, dst, n, modTH2);
+#endif
+        default:
+            return relPhase3Scalar(I1, I2, I3, dst, n, modTH2);
+        }
+    }
+
+    void relPhase4(const uchar *I1, const uchar *I2, const uchar *I3, const uchar *I4, float *dst, int n, float modTH2)
+    {
+        switch (getIsa())
+        {
+#ifdef PHASE_KERNELS_X86
+        case ISA_AVX512:
+            return avx512::relPhase4(I1, I2, I3, I4, dst, n, modTH2);
+        case ISA_AVX2:
+            return avx2::relPhase4(I1, I2, I3, I4, dst, n, modTH2);
+        case ISA_SSE4:
+            return sse4::relPhase4(I1, I2, I3, I4, dst, n, modTH2);
+#endif
+        default:
+            return relPhase4Scalar(I1, I2, I3, I4, dst, n, modTH2);
+        }
+    }
+
+    void wrapPhase(const float *y, const float *x, float *dst, int n, float modTH2)
+    {
+        switch (getIsa())
+        {
+#ifdef PHASE_KERNELS_X86
+        case ISA_AVX512:
+            return avx512::wrapPhase(y, x, dst, n, modTH2);
+        case ISA_AVX2:
+            return avx2::wrapPhase(y, x, dst, n, modTH2);
+        case ISA_SSE4:
+            return sse4::wrapPhase(y, x, dst, n, modTH2);
+#endif
+        default:
+            return wrapPhaseScalar(y, x, dst, n, modTH2);
+        }
+    }
+
+    void smoothPhase(const float *center, const float *const *taps, int pairNum, float *dst, int n, float th)
+    {
+        switch (getIsa())
+        {
+#ifdef PHASE_KERNELS_X86
+        case ISA_AVX512:
+            return avx512::smoothPhase(center, taps, pairNum, dst, n, th);
+        case ISA_AVX2:
+            return avx2::smoothPhase(center, taps, pairNum, dst, n, th);
+        case ISA_SSE4:
+            return sse4::smoothPhase(center, taps, pairNum, dst, n, th);
+#endif
+        default:
+            return smoothPhaseScalar(center, taps, pairNum, dst, n, th);
+        }
+    }
+}
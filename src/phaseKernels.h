@@ -0,0 +1,41 @@
+#ifndef PHASE_KERNELS
+#define PHASE_KERNELS
+
+// Vectorized row kernels of wrapped phase for single precision.
+// Kernels are built for SSE4.1, AVX2 and AVX-512 and picked at runtime by CPU features.
+// Phase is calculated with a polynomial atan2, max absolute error is 3e-7 rad (about 1 ulp at pi).
+// Modulation is tested in squared form, sum < modTH2 marks the pixel NaN, where sum is x^2 + y^2.
+namespace phaseKernels
+{
+    // Instruction sets.
+    enum
+    {
+        ISA_SCALAR = 0,
+        ISA_SSE4 = 1,
+        ISA_AVX2 = 2,
+        ISA_AVX512 = 3
+    };
+
+    // Best instruction set supported by this CPU.
+    int detectIsa();
+    // Instruction set used by kernels. Default is detectIsa().
+    int getIsa();
+    // Force kernels to use a lower instruction set, e.g. for benchmarks.
+    void setIsa(int isa);
+
+    // Polynomial atan2 used by all kernels.
+    float atan2Approx(float y, float x);
+
+    // 3-step relative phase. y = sqrt(3) * (I1 - I2), x = 2 * I2 - I1 - I3.
+    void relPhase3(const unsigned char *I1, const unsigned char *I2, const unsigned char *I3, float *dst, int n, float modTH2);
+    // 4-step relative phase. y = I4 - I2, x = I1 - I3.
+    void relPhase4(const unsigned char *I1, const unsigned char *I2, const unsigned char *I3, const unsigned char *I4, float *dst, int n, float modTH2);
+    // Wrapped phase of accumulated y and x.
+    void wrapPhase(const float *y, const float *x, float *dst, int n, float modTH2);
+    // Mean of center and the symmetric tap pairs whose taps at distance d are both within th of the line center -+ s * d,
+    // unbiased on phase ramps. s is the slope of the flatter side of the nearest pair, NaN or over pi counts as 0.
+    // Pairs with a NaN tap are skipped and NaN center gives NaN. taps holds 2 * pairNum pointers, each read at [0, n) as center.
+    void smoothPhase(const float *center, const float *const *taps, int pairNum, float *dst, int n, float th);
+}
+
+#endif
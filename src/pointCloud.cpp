@@ -0,0 +1,137 @@
+#include "pointCloud.h"
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+// Points written per chunk when interleaving PLY vertices.
+#define PLY_CHUNK 4096
+
+static bool bigEndian()
+{
+    uint16_t v = 1;
+    unsigned char b;
+    memcpy(&b, &v, 1);
+    return b == 0;
+}
+
+// Write n 4-byte values in little-endian order.
+static void writeLE(ofstream &file, const void *data, size_t n)
+{
+    if (!bigEndian())
+    {
+        file.write((const char *)data, n * 4);
+        return;
+    }
+    const unsigned char *src = (const unsigned char *)data;
+    vector<unsigned char> buf(n * 4);
+    for (size_t i = 0; i < n * 4; i += 4)
+    {
+        buf[i] = src[i + 3];
+        buf[i + 1] = src[i + 2];
+        buf[i + 2] = src[i + 1];
+        buf[i + 3] = src[i];
+    }
+    file.write((const char *)&buf[0], buf.size());
+}
+
+static void openFile(ofstream &file, const string &filePath)
+{
+    file.open(filePath, ios::out | ios::binary);
+    if (file.fail())
+    {
+        cout << "Can't open point cloud file!" << endl;
+        throw exception();
+    }
+}
+
+// Close file. Failed writes and close are reported.
+static void closeFile(ofstream &file)
+{
+    file.close();
+    if (file.fail())
+    {
+        cout << "Can't write point cloud file!" << endl;
+        throw exception();
+    }
+}
+
+size_t pointCloud::size() const
+{
+    return x.size();
+}
+
+bool pointCloud::hasIntensity() const
+{
+    return !intensity.empty();
+}
+
+void pointCloud::clear()
+{
+    x.clear();
+    y.clear();
+    z.clear();
+    intensity.clear();
+}
+
+void pointCloud::append(const pointCloud &cloud)
+{
+    x.insert(x.end(), cloud.x.begin(), cloud.x.end());
+    y.insert(y.end(), cloud.y.begin(), cloud.y.end());
+    z.insert(z.end(), cloud.z.begin(), cloud.z.end());
+    intensity.insert(intensity.end(), cloud.intensity.begin(), cloud.intensity.end());
+}
+
+void pointCloud::savePLY(const string &filePath) const
+{
+    ofstream file;
+    openFile(file, filePath);
+
+    file << "ply\nformat binary_little_endian 1.0\n";
+    file << "element vertex " << size() << "\n";
+    file << "property float x\nproperty float y\nproperty float z\n";
+    if (hasIntensity())
+        file << "property float intensity\n";
+    file << "end_header\n";
+
+    // PLY stores vertices interleaved.
+    int fields = hasIntensity() ? 4 : 3;
+    vector<float> chunk(PLY_CHUNK * fields);
+    for (size_t begin = 0; begin < size(); begin += PLY_CHUNK)
+    {
+        size_t n = min((size_t)PLY_CHUNK, size() - begin);
+        for (size_t i = 0; i < n; ++i)
+        {
+            float *v = &chunk[i * fields];
+            v[0] = x[begin + i];
+            v[1] = y[begin + i];
+            v[2] = z[begin + i];
+            if (hasIntensity())
+                v[3] = intensity[begin + i];
+        }
+        writeLE(file, &chunk[0], n * fields);
+    }
+    closeFile(file);
+}
+
+void pointCloud::saveRaw(const string &filePath) const
+{
+    ofstream file;
+    openFile(file, filePath);
+
+    uint64_t n = size();
+    uint32_t flag = hasIntensity() ? 1 : 0;
+    uint32_t header[3] = {(uint32_t)(n & 0xFFFFFFFF), (uint32_t)(n >> 32), flag};
+    writeLE(file, header, 3);
+    if (n)
+    {
+        writeLE(file, &x[0], n);
+        writeLE(file, &y[0], n);
+        writeLE(file, &z[0], n);
+        if (flag)
+            writeLE(file, &intensity[0], n);
+    }
+    closeFile(file);
+}
@@ -0,0 +1,27 @@
+#ifndef POINT_CLOUD
+#define POINT_CLOUD
+
+#include <string>
+#include <vector>
+
+// Valid points of a frame in SoA layout.
+struct pointCloud
+{
+    std::vector<float> x, y, z;
+    // Optional intensity or modulation of each point. Empty if not used.
+    std::vector<float> intensity;
+
+    size_t size() const;
+    bool hasIntensity() const;
+    void clear();
+    // Append points of another cloud.
+    void append(const pointCloud &cloud);
+
+    // Save as binary little-endian PLY.
+    void savePLY(const std::string &filePath) const;
+    // Save as raw little-endian file.
+    // Layout: uint64 point number, uint32 intensity flag, then x[], y[], z[] and intensity[] as float32.
+    void saveRaw(const std::string &filePath) const;
+};
+
+#endif
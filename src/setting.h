@@ -5,11 +5,30 @@
 #include <omp.h>
 
 // N-Step algorithm.
+// THREE_STEP_SHIFT keeps the original atan2(sqrt(3) * (I1 - I2), 2 * I2 - I1 - I3), which is monotonic but not linear in
+// phase for 2 * pi / 3 shifts, so calibrate and match only against maps of the same method.
+// FOUR_STEP_SHIFT and N_STEP_SHIFT expect I[n] = A + B * cos(phi + 2 * pi * n / N), n from 0, and return phi.
+// N_STEP_SHIFT with 3 steps is the linear 3-step method and differs from THREE_STEP_SHIFT on the same images,
+// e.g. phi = 1.0 gives 1.0 and 2.41, so use it for new 3-step setups and do not mix it with THREE_STEP_SHIFT.
 #define THREE_STEP_SHIFT 0
 #define FOUR_STEP_SHIFT 1
+#define N_STEP_SHIFT 2
 // Steps to calculate final hetero phase map.
 #define TWO_STEP_HETERODYNE 0
 #define THREE_STEP_HETERODYNE 1
+// Unwrapping method of N frequencies.
+#define HETERODYNE_UNWRAP 0
+#define HIERARCHICAL_UNWRAP 1
+// Max number of frequencies.
+#define MAX_FREQ_NUM 8
+// Quality maps of phase calculation.
+#define QUALITY_MODULATION 1
+#define QUALITY_TEXTURE 2
+#define QUALITY_CONFIDENCE 4
+#define QUALITY_ALL 7
+// Phase search algorithm.
+#define FULL_SEARCH 0
+#define MONOTONIC_SEARCH 1
 // Math quantities.
 #define ROOT_THREE 1.73205081
 #define TWO_THIRD 0.66666667
@@ -28,7 +47,23 @@ typedef double TYPE;
 #define CV_TYPE CV_64FC1
 #endif
 
-// Phase filter window size.
+// Default phase filter window size, odd up to PHASE_FILTER_MAXSIZE.
 #define PHASE_FILTER_WINSIZE 3
+#define PHASE_FILTER_MAXSIZE 15
+// Phase filter averages symmetric tap pairs within PHASE_FILTER_TH radians of the local phase ramp through the center
+// pixel, so that wide windows work on fine fringes while larger steps are kept.
+#define PHASE_FILTER_TH 1.0
+// Rows per tile of fused phase calculation.
+#define PHASE_TILE_ROWS 32
+// Missing value of CV_16U disparity prior. speckle::match never outputs it.
+#define PRIOR_NONE 0xFFFF
+// Conventions of disparity prior.
+// SPECKLE_PRIOR is CV_16U output of speckle::match: the match of left pixel (i, j) is near column j + prior, PRIOR_NONE if missing.
+// DISPARITY_PRIOR is CV_TYPE disparity of calDisparity: the match is near column j - prior, NaN if missing.
+#define SPECKLE_PRIOR 0
+#define DISPARITY_PRIOR 1
+// Invalid code and phase offset of 16-bit fixed-point phase.
+#define PHASE_INVALID 0xFFFF
+#define PHASE_FIXED_OFFSET 3.14159265
 
 #endif
\ No newline at end of file
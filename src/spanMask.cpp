@@ -0,0 +1,130 @@
+#include "spanMask.h"
+#include <iostream>
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+using namespace cv;
+
+spanMask::spanMask() : size(0, 0)
+{
+}
+
+spanMask::spanMask(Size img_size, Rect roi)
+{
+    roi = roi & Rect(0, 0, img_size.width, img_size.height);
+    vector<vector<int>> rows(img_size.height);
+    if (roi.area() > 0)
+        for (int i = roi.y; i < roi.y + roi.height; ++i)
+        {
+            rows[i].push_back(roi.x);
+            rows[i].push_back(roi.x + roi.width);
+        }
+    build(img_size, rows);
+}
+
+spanMask::spanMask(const Mat &mask, int th)
+{
+    if (mask.type() != CV_8UC1)
+    {
+        cout << "Mask must be CV_8UC1!" << endl;
+        throw exception();
+    }
+    vector<vector<int>> rows(mask.rows);
+#pragma omp parallel for
+    for (int i = 0; i < mask.rows; ++i)
+    {
+        const uchar *m = mask.ptr<uchar>(i);
+        appendSpans(mask.cols, [&](int j) { return m[j] > th; }, rows[i]);
+    }
+    build(mask.size(), rows);
+}
+
+void spanMask::build(Size img_size, const vector<vector<int>> &rowSpans)
+{
+    size = img_size;
+    rowSpan.resize(size.height + 1);
+    rowSpan[0] = 0;
+    for (int i = 0; i < size.height; ++i)
+        rowSpan[i + 1] = rowSpan[i] + rowSpans[i].size() / 2;
+    spans.resize(2 * rowSpan[size.height]);
+    for (int i = 0; i < size.height; ++i)
+        copy(rowSpans[i].begin(), rowSpans[i].end(), spans.begin() + 2 * rowSpan[i]);
+}
+
+Size spanMask::getSize() const
+{
+    return size;
+}
+
+bool spanMask::empty() const
+{
+    return size.area() == 0;
+}
+
+int spanMask::spanNum(int i) const
+{
+    return rowSpan[i + 1] - rowSpan[i];
+}
+
+const int *spanMask::rowSpans(int i) const
+{
+    return spans.empty() ? NULL : &spans[2 * rowSpan[i]];
+}
+
+long spanMask::area() const
+{
+    long n = 0;
+    for (size_t k = 0; k < spans.size(); k += 2)
+        n += spans[k + 1] - spans[k];
+    return n;
+}
+
+Rect spanMask::boundingRect() const
+{
+    int x0 = INT_MAX, x1 = INT_MIN, y0 = INT_MAX, y1 = INT_MIN;
+    for (int i = 0; i < size.height; ++i)
+    {
+        int n = spanNum(i);
+        if (n == 0)
+            continue;
+        const int *s = rowSpans(i);
+        x0 = min(x0, s[0]);
+        x1 = max(x1, s[2 * n - 1]);
+        y0 = min(y0, i);
+        y1 = i + 1;
+    }
+    return y1 < 0 ? Rect() : Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+bool spanMask::contains(int i, int j) const
+{
+    if (i < 0 || i >= size.height)
+        return false;
+    // Binary search the last span beginning at or before j.
+    const int *s = rowSpans(i);
+    int lo = 0, hi = spanNum(i) - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (s[2 * mid] <= j)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return hi >= 0 && j < s[2 * hi + 1];
+}
+
+void spanMask::toMat(Mat &mask) const
+{
+    mask.create(size, CV_8UC1);
+#pragma omp parallel for
+    for (int i = 0; i < size.height; ++i)
+    {
+        uchar *m = mask.ptr<uchar>(i);
+        fill(m, m + size.width, 0);
+        const int *s = rowSpans(i);
+        for (int k = 0; k < spanNum(i); ++k)
+            fill(m + s[2 * k], m + s[2 * k + 1], 255);
+    }
+}
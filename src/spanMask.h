@@ -0,0 +1,68 @@
+#ifndef SPAN_MASK
+#define SPAN_MASK
+
+#include <vector>
+#include "setting.h"
+
+// Validity mask stored as run-length spans, so that stages iterate valid pixels only.
+// Each row holds spans [begin, end) of columns, in increasing order and not overlapping.
+class spanMask
+{
+protected:
+    cv::Size size;
+    // Spans of row i are spans[2 * k] and spans[2 * k + 1] for k in [rowSpan[i], rowSpan[i + 1]).
+    std::vector<int> rowSpan;
+    std::vector<int> spans;
+
+public:
+    // Empty mask.
+    spanMask();
+    // Mask of pixels inside roi.
+    spanMask(cv::Size img_size, cv::Rect roi);
+    // Mask of pixels over th of a CV_8UC1 map, e.g. a user bitmask, or phaseQuality::modulation with a modulation threshold.
+    spanMask(const cv::Mat &mask, int th = 0);
+
+    // Build from spans of each row, rowSpans[i] holding begin and end pairs of row i.
+    void build(cv::Size img_size, const std::vector<std::vector<int>> &rowSpans);
+
+    cv::Size getSize() const;
+    bool empty() const;
+    // Number of spans of row i.
+    int spanNum(int i) const;
+    // Begin and end pairs of row i.
+    const int *rowSpans(int i) const;
+    // Number of pixels in mask.
+    long area() const;
+    // Bounding box of pixels in mask.
+    cv::Rect boundingRect() const;
+    // Whether pixel (i, j) is in mask.
+    bool contains(int i, int j) const;
+    // CV_8UC1 map, 255 in mask and 0 elsewhere.
+    void toMat(cv::Mat &mask) const;
+};
+
+// Append spans of valid pixels of a row to rowSpans. valid(j) tells whether column j is valid.
+template <typename F>
+inline void appendSpans(int cols, const F &valid, std::vector<int> &rowSpans)
+{
+    int begin = -1;
+    for (int j = 0; j < cols; ++j)
+    {
+        bool v = valid(j);
+        if (v && begin < 0)
+            begin = j;
+        else if (!v && begin >= 0)
+        {
+            rowSpans.push_back(begin);
+            rowSpans.push_back(j);
+            begin = -1;
+        }
+    }
+    if (begin >= 0)
+    {
+        rowSpans.push_back(begin);
+        rowSpans.push_back(cols);
+    }
+}
+
+#endif
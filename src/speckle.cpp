@@ -1,87 +1,409 @@
 #include "speckle.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPECKLE_POPCNT
+#define SPECKLE_INLINE inline __attribute__((always_inline))
+#else
+#define SPECKLE_INLINE inline
+#endif
+
 using namespace std;
 
-speckle::speckle(int _winSize, int _maxDisparity = 64)
+speckle::speckle(int _winSize, int _maxDisparity)
+{
+    init(_winSize, _maxDisparity);
+    sgm = false;
+}
+
+speckle::speckle(int _winSize, int _maxDisparity, int _P1, int _P2, int stripe_rows, int stripe_halo)
 {
-    if (winSize < 3)
+    init(_winSize, _maxDisparity);
+    if (_P1 < 0 || _P2 < _P1 || stripe_rows < 1 || stripe_halo < 0)
+    {
+        cout << "Invalid semi-global parameters!" << endl;
+        throw exception();
+    }
+    sgm = true;
+    P1 = _P1;
+    P2 = _P2;
+    stripeRows = stripe_rows;
+    stripeHalo = stripe_halo;
+}
+
+void speckle::init(int _winSize, int _maxDisparity)
+{
+    if (_winSize < 3)
     {
         cout << "Window size can not less than 3!" << endl;
         throw exception();
     }
+    if (_winSize > 63)
+    {
+        cout << "Window size can not larger than 63!" << endl;
+        throw exception();
+    }
+    // Disparity PRIOR_NONE is reserved for missing prior of stereoProcessor.
+    if (_maxDisparity < 1 || _maxDisparity > PRIOR_NONE)
+    {
+        cout << "Max disparity must be in [1, 65535]!" << endl;
+        throw exception();
+    }
+    workspace = NULL;
+    instrument = NULL;
     maxDisparity = _maxDisparity;
     winSize = _winSize;
     winArea = _winSize * _winSize;
+    descWords = (winArea + 63) / 64;
 }
 
 speckle::~speckle()
 {
 }
 
+void speckle::setWorkspace(pmpWorkspace *ws)
+{
+    workspace = ws;
+}
+
+void speckle::setInstrument(pmpInstrument *ins)
+{
+    instrument = ins;
+}
+
 void speckle::DB(cv::Mat &src, cv::Mat &dst)
 {
+    PMP_CALL(instrument);
+    // Window sums from integral image, pixels out of image count as 0.
+    cv::Mat sum;
+    if (workspace)
+        sum = workspace->frame(WS_SPECKLE_SUM, cv::Size(src.cols + 1, src.rows + 1), CV_32S);
+    cv::integral(src, sum, CV_32S);
+
     // Create the empty binary array.
     dst.create(cv::Size(src.cols, src.rows), CV_8U);
     int halfSize = winSize / 2;
-    cv::Rect imgBoundary(0, 0, src.rows, src.cols);
+#pragma omp parallel for
     for (int i = 0; i < src.rows; i++)
     {
+        PMP_ROWS(instrument, STAGE_SPECKLE, 1);
+        const int *sumTop = sum.ptr<int>(max(i - halfSize, 0));
+        const int *sumBottom = sum.ptr<int>(min(i + halfSize + 1, src.rows));
+        const uchar *I = src.ptr<uchar>(i);
+        uchar *D = dst.ptr<uchar>(i);
         for (int j = 0; j < src.cols; j++)
         {
-            unsigned int sum = 0;
-            for (int dy = -halfSize; dy <= halfSize; dy++)
+            int left = max(j - halfSize, 0), right = min(j + halfSize + 1, src.cols);
+            int winSum = sumBottom[right] - sumBottom[left] - sumTop[right] + sumTop[left];
+            D[j] = (winArea * I[j] > winSum) ? 1 : 0;
+        }
+    }
+}
+
+void speckle::census(const cv::Mat &src, int cols, vector<uint64_t> &desc)
+{
+    int halfSize = winSize / 2;
+    int rows = src.rows;
+    rowBits.resize((size_t)rows * cols);
+    desc.resize((size_t)rows * cols * descWords);
+
+    // Bit k of rowBits(i, j) is pixel (i, j - halfSize + k).
+#pragma omp parallel for
+    for (int i = 0; i < rows; i++)
+    {
+        PMP_ROWS(instrument, STAGE_SPECKLE, 1);
+        const uchar *I = src.ptr<uchar>(i);
+        uint64_t *bits = &rowBits[(size_t)i * cols];
+        uint64_t b = 0;
+        for (int v = -halfSize; v <= halfSize; v++)
+            if (v >= 0 && v < src.cols)
+                b |= (uint64_t)(I[v] != 0) << (v + halfSize);
+        bits[0] = b;
+        for (int j = 1; j < cols; j++)
+        {
+            int v = j + halfSize;
+            b >>= 1;
+            if (v < src.cols)
+                b |= (uint64_t)(I[v] != 0) << (winSize - 1);
+            bits[j] = b;
+        }
+    }
+
+    // Row dy of the window takes bits [dy * winSize, (dy + 1) * winSize) of the descriptor.
+#pragma omp parallel for
+    for (int i = 0; i < rows; i++)
+    {
+        PMP_ROWS(instrument, STAGE_SPECKLE, 0);
+        uint64_t *D = &desc[(size_t)i * cols * descWords];
+        fill(D, D + (size_t)cols * descWords, 0);
+        for (int dy = 0; dy < winSize; dy++)
+        {
+            int u = i + dy - halfSize;
+            if (u < 0 || u >= rows)
+                continue;
+            const uint64_t *bits = &rowBits[(size_t)u * cols];
+            int offset = dy * winSize, word = offset / 64, shift = offset % 64;
+            for (int j = 0; j < cols; j++)
             {
-                for (int dx = -halfSize; dx <= halfSize; dx++)
-                {
-                    int u = i + dy;
-                    int v = j + dx;
-                    bool inside = imgBoundary.contains(cv::Point(u, v));
-                    sum += inside ? src.at<uchar>(u, v) : 0;
-                }
+                uint64_t *d = D + (size_t)j * descWords;
+                d[word] |= bits[j] << shift;
+                if (shift + winSize > 64)
+                    d[word + 1] |= bits[j] >> (64 - shift);
             }
-            dst.at<uchar>(i, j) = (winArea * src.at<uchar>(i, j) > sum) ? 1 : 0;
         }
     }
 }
 
-void speckle::match(cv::Mat &src1, cv::Mat &src2, cv::Mat &disparity)
+// Find disparity of minimum Hamming distance for one row. First minimum wins.
+template <int WORDS>
+static SPECKLE_INLINE void hammingRow(const uint64_t *d1, const uint64_t *d2, int words, int cols, int maxDisparity, ushort *dst)
 {
-    // Create the empty cost array.
-    disparity.create(cv::Size(src1.cols, src1.rows), CV_8U);
-    int halfSize = winSize / 2;
-    cv::Rect imgBoundary(0, 0, src1.rows, src1.cols);
-    for (int i = 0; i < src1.rows; i++)
+    int n = WORDS ? WORDS : words;
+    for (int j = 0; j < cols; j++)
+    {
+        const uint64_t *a = d1 + (size_t)j * n;
+        int minDis = INT32_MAX;
+        ushort dis = 0;
+        for (int k = 0; k < maxDisparity; k++)
+        {
+            const uint64_t *b = d2 + (size_t)(j + k) * n;
+            int hamingDis = 0;
+            for (int w = 0; w < n; w++)
+                hamingDis += __builtin_popcountll(a[w] ^ b[w]);
+            if (hamingDis < minDis)
+            {
+                minDis = hamingDis;
+                dis = k;
+            }
+        }
+        dst[j] = dis;
+    }
+}
+
+static void hammingRowGeneric(const uint64_t *d1, const uint64_t *d2, int words, int cols, int maxDisparity, ushort *dst)
+{
+    if (words == 1)
+        hammingRow<1>(d1, d2, words, cols, maxDisparity, dst);
+    else if (words == 2)
+        hammingRow<2>(d1, d2, words, cols, maxDisparity, dst);
+    else
+        hammingRow<0>(d1, d2, words, cols, maxDisparity, dst);
+}
+
+#ifdef SPECKLE_POPCNT
+// Same row matcher built with hardware popcount.
+__attribute__((target("popcnt"))) static void hammingRowPopcnt(const uint64_t *d1, const uint64_t *d2, int words, int cols, int maxDisparity, ushort *dst)
+{
+    if (words == 1)
+        hammingRow<1>(d1, d2, words, cols, maxDisparity, dst);
+    else if (words == 2)
+        hammingRow<2>(d1, d2, words, cols, maxDisparity, dst);
+    else
+        hammingRow<0>(d1, d2, words, cols, maxDisparity, dst);
+}
+#endif
+
+// Hamming distance of every disparity for one row. cost is cols x maxDisparity.
+template <int WORDS>
+static SPECKLE_INLINE void costRow(const uint64_t *d1, const uint64_t *d2, int words, int cols, int maxDisparity, uint16_t *cost)
+{
+    int n = WORDS ? WORDS : words;
+    for (int j = 0; j < cols; j++)
+    {
+        const uint64_t *a = d1 + (size_t)j * n;
+        uint16_t *c = cost + (size_t)j * maxDisparity;
+        for (int k = 0; k < maxDisparity; k++)
+        {
+            const uint64_t *b = d2 + (size_t)(j + k) * n;
+            int hamingDis = 0;
+            for (int w = 0; w < n; w++)
+                hamingDis += __builtin_popcountll(a[w] ^ b[w]);
+            c[k] = hamingDis;
+        }
+    }
+}
+
+static void costRowGeneric(const uint64_t *d1, const uint64_t *d2, int words, int cols, int maxDisparity, uint16_t *cost)
+{
+    if (words == 1)
+        costRow<1>(d1, d2, words, cols, maxDisparity, cost);
+    else
+        costRow<0>(d1, d2, words, cols, maxDisparity, cost);
+}
+
+#ifdef SPECKLE_POPCNT
+__attribute__((target("popcnt"))) static void costRowPopcnt(const uint64_t *d1, const uint64_t *d2, int words, int cols, int maxDisparity, uint16_t *cost)
+{
+    if (words == 1)
+        costRow<1>(d1, d2, words, cols, maxDisparity, cost);
+    else
+        costRow<0>(d1, d2, words, cols, maxDisparity, cost);
+}
+#endif
+
+// One step of semi-global path. cur = C + min(prev[d], prev[d +- 1] + P1, min(prev) + P2) - min(prev), then S += cur.
+// Both saturate at UINT16_MAX, which large P2 and wide windows can reach.
+static inline void pathStep(const uint16_t *C, const uint16_t *prev, uint16_t *cur, uint16_t *S, int D, int P1, int P2)
+{
+    int minPrev = UINT16_MAX;
+#pragma omp simd reduction(min : minPrev)
+    for (int d = 0; d < D; d++)
+        minPrev = min(minPrev, (int)prev[d]);
+
+    int jump = minPrev + P2;
+#pragma omp simd
+    for (int d = 0; d < D; d++)
     {
-        for (int j = 0; j < src1.cols; j++)
+        int best = min((int)prev[d], jump);
+        int lower = (d > 0) ? prev[d - 1] + P1 : jump;
+        int upper = (d < D - 1) ? prev[d + 1] + P1 : jump;
+        best = min(best, min(lower, upper));
+        int v = C[d] + best - minPrev;
+        cur[d] = min(v, (int)UINT16_MAX);
+        S[d] = min(S[d] + v, (int)UINT16_MAX);
+    }
+}
+
+// First step of a path takes raw cost.
+static inline void pathStart(const uint16_t *C, uint16_t *cur, uint16_t *S, int D)
+{
+#pragma omp simd
+    for (int d = 0; d < D; d++)
+    {
+        cur[d] = C[d];
+        S[d] = min(S[d] + C[d], (int)UINT16_MAX);
+    }
+}
+
+void speckle::matchSGM(int rows, int cols1, int cols2, cv::Mat &disparity)
+{
+    void (*costFn)(const uint64_t *, const uint64_t *, int, int, int, uint16_t *) = costRowGeneric;
+#ifdef SPECKLE_POPCNT
+    if (__builtin_cpu_supports("popcnt"))
+        costFn = costRowPopcnt;
+#endif
+
+    int D = maxDisparity;
+    size_t rowSize = (size_t)cols1 * D;
+    disparity.create(cv::Size(cols1, rows), CV_16U);
+    // Scratch slots are reserved here, as nothing may throw in the parallel region.
+    scratchBuffer<uint16_t>::reserve(workspace, 0, 2 * D);
+    scratchBuffer<uint16_t>::reserve(workspace, 1, 2 * rowSize);
+
+    for (int r0 = 0; r0 < rows; r0 += stripeRows)
+    {
+        int r1 = min(r0 + stripeRows, rows);
+        // Halo rows let vertical paths settle before reaching the stripe.
+        int e0 = max(r0 - stripeHalo, 0), e1 = min(r1 + stripeHalo, rows);
+        int n = e1 - e0;
+        costVolume.resize(n * rowSize);
+        aggVolume.assign(n * rowSize, 0);
+
+#pragma omp parallel
         {
-            u_int16_t minHamingDis = winArea;
-            u_int8_t dis = 0;
-            for (int k = 0; k < maxDisparity; k++)
+            scratchBuffer<uint16_t> path(workspace, 0, 2 * D);
+#pragma omp for
+            for (int i = e0; i < e1; i++)
             {
-                u_int16_t hamingDis = 0;
-                for (int dy = -halfSize; dy <= halfSize; dy++)
+                PMP_ROWS(instrument, STAGE_SPECKLE, 0);
+                uint16_t *C = &costVolume[(i - e0) * rowSize];
+                uint16_t *S = &aggVolume[(i - e0) * rowSize];
+                costFn(&desc1[(size_t)i * cols1 * descWords], &desc2[(size_t)i * cols2 * descWords], descWords, cols1, D, C);
+                // Halo rows only feed cost to vertical paths, their aggregated cost is not read.
+                if (i < r0 || i >= r1)
+                    continue;
+
+                // Left to right and right to left.
+                uint16_t *prev = path.data(), *cur = path.data() + D;
+                pathStart(C, prev, S, D);
+                for (int j = 1; j < cols1; j++)
                 {
-                    for (int dx = -halfSize; dx <= halfSize; dx++)
-                    {
-                        int u = i + dy;
-                        int v1 = j + dx;
-                        int v2 = j + dx + k;
-                        bool inside1 = imgBoundary.contains(cv::Point(u, v1));
-                        bool inside2 = imgBoundary.contains(cv::Point(u, v2));
-
-                        if (inside1 & inside2)
-                            hamingDis += src1.at<u_int8_t>(u, v1) == src2.at<u_int8_t>(u, v2);
-                        else if (inside1 ^ inside2)
-                            hamingDis += inside1? (src1.at<u_int8_t>(u, v1) == 0) : (src2.at<u_int8_t>(u, v2) == 0);
-                    }
+                    pathStep(C + j * D, prev, cur, S + j * D, D, P1, P2);
+                    swap(prev, cur);
                 }
-                if (hamingDis < minHamingDis)
+                pathStart(C + (cols1 - 1) * D, prev, S + (cols1 - 1) * D, D);
+                for (int j = cols1 - 2; j >= 0; j--)
                 {
-                    minHamingDis = hamingDis;
-                    dis = k;
+                    pathStep(C + j * D, prev, cur, S + j * D, D, P1, P2);
+                    swap(prev, cur);
                 }
             }
-            disparity.at<u_int8_t>(i, j) = dis;
         }
+
+        // Top to bottom and bottom to top. Rows are sequential, columns are parallel.
+        // Columns are too short to time one by one, the pass is recorded to the calling thread.
+        scratchBuffer<uint16_t> pathRows(workspace, 1, 2 * rowSize);
+        {
+            PMP_ROWS(instrument, STAGE_SPECKLE, 0);
+            for (int dir = 0; dir < 2; dir++)
+            {
+                int first = dir ? n - 1 : 0, step = dir ? -1 : 1;
+                uint16_t *prev = pathRows.data(), *cur = pathRows.data() + rowSize;
+                for (int t = 0, i = first; t < n; t++, i += step)
+                {
+                    uint16_t *C = &costVolume[i * rowSize];
+                    uint16_t *S = &aggVolume[i * rowSize];
+#pragma omp parallel for
+                    for (int j = 0; j < cols1; j++)
+                    {
+                        if (t == 0)
+                            pathStart(C + j * D, cur + j * D, S + j * D, D);
+                        else
+                            pathStep(C + j * D, prev + j * D, cur + j * D, S + j * D, D, P1, P2);
+                    }
+                    swap(prev, cur);
+                }
+            }
+        }
+
+        // Disparity of minimum aggregated cost. First minimum wins.
+#pragma omp parallel for
+        for (int i = r0; i < r1; i++)
+        {
+            PMP_ROWS(instrument, STAGE_SPECKLE, 1);
+            ushort *dst = disparity.ptr<ushort>(i);
+            const uint16_t *S = &aggVolume[(i - e0) * rowSize];
+            for (int j = 0; j < cols1; j++)
+            {
+                const uint16_t *s = S + j * D;
+                int minCost = UINT16_MAX + 1, dis = 0;
+                for (int d = 0; d < D; d++)
+                    if (s[d] < minCost)
+                    {
+                        minCost = s[d];
+                        dis = d;
+                    }
+                dst[j] = dis;
+            }
+        }
+    }
+}
+
+void speckle::match(cv::Mat &src1, cv::Mat &src2, cv::Mat &disparity)
+{
+    PMP_CALL(instrument);
+    // Descriptors of src2 are padded so that j + k never leaves the buffer.
+    int cols1 = src1.cols, cols2 = src1.cols + maxDisparity;
+    census(src1, cols1, desc1);
+    census(src2, cols2, desc2);
+
+    if (sgm)
+    {
+        matchSGM(src1.rows, cols1, cols2, disparity);
+        return;
     }
-}
\ No newline at end of file
+
+    void (*matchFn)(const uint64_t *, const uint64_t *, int, int, int, ushort *) = hammingRowGeneric;
+#ifdef SPECKLE_POPCNT
+    if (__builtin_cpu_supports("popcnt"))
+        matchFn = hammingRowPopcnt;
+#endif
+
+    // Create the disparity array.
+    disparity.create(cv::Size(src1.cols, src1.rows), CV_16U);
+#pragma omp parallel for
+    for (int i = 0; i < src1.rows; i++)
+    {
+        PMP_ROWS(instrument, STAGE_SPECKLE, 1);
+        matchFn(&desc1[(size_t)i * cols1 * descWords], &desc2[(size_t)i * cols2 * descWords], descWords, cols1, maxDisparity, disparity.ptr<ushort>(i));
+    }
+}
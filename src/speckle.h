@@ -1,7 +1,11 @@
 #ifndef SPECKLE
 #define SPECKLE
 
+#include <vector>
+#include <cstdint>
 #include "setting.h"
+#include "workspace.h"
+#include "instrument.h"
 
 class speckle
 {
@@ -9,12 +13,45 @@ protected:
     int winSize;
     int winArea;
     int maxDisparity;
+    // 64-bit words per census descriptor.
+    int descWords;
+    // Horizontal window bits and packed window descriptors of both images.
+    std::vector<uint64_t> rowBits;
+    std::vector<uint64_t> desc1, desc2;
+
+    // Semi-global aggregation.
+    bool sgm;
+    // Penalties of disparity change by 1 and by more than 1, in Hamming distance.
+    int P1, P2;
+    // Rows per stripe of cost volume, and extra rows above and below a stripe for vertical paths.
+    int stripeRows, stripeHalo;
+    // Cost volume and aggregated cost of a stripe. Disparity is the innermost dimension.
+    std::vector<uint16_t> costVolume, aggVolume;
+    // Workspace of temporaries. NULL to allocate them per call.
+    pmpWorkspace *workspace;
+    // Stage timers and counters. NULL to disable.
+    pmpInstrument *instrument;
+
+    // Check and set window size and max disparity.
+    void init(int _winSize, int _maxDisparity);
+    // Pack binary window of every pixel into descWords words. Columns beyond src are zero padded up to cols.
+    void census(const cv::Mat &src, int cols, std::vector<uint64_t> &desc);
+    // Aggregate costs along 4 paths stripe by stripe and take disparity of minimum.
+    void matchSGM(int rows, int cols1, int cols2, cv::Mat &disparity);
 public:
     speckle(int _winSize, int _maxDisparity = 64);
+    // Speckle matcher with semi-global aggregation. Memory is bounded by stripe_rows + 2 * stripe_halo rows of cost volume.
+    speckle(int _winSize, int _maxDisparity, int _P1, int _P2, int stripe_rows = 64, int stripe_halo = 16);
     ~speckle();
-    
+    // Draw temporaries from ws. NULL to allocate them per call.
+    void setWorkspace(pmpWorkspace *ws);
+    // Record stage timers and counters to ins. NULL to disable.
+    void setInstrument(pmpInstrument *ins);
+
     // Implementatation of DB algorithm.
     void DB(cv::Mat &src, cv::Mat &dst);
+    // Match binary images by Hamming distance of window descriptors. disparity is CV_16U.
+    // The match of src1 pixel (i, j) is src2 pixel (i, j + disparity), the opposite of stereoProcessor::calDisparity.
     void match(cv::Mat &src1, cv::Mat &src2, cv::Mat &disparity);
 };
 
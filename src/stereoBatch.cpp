@@ -0,0 +1,117 @@
+#include "stereoBatch.h"
+
+using namespace std;
+using namespace cv;
+
+stereoBatch::stereoBatch(int threads, bool output_cloud) : threads(threads),
+                                                           outputCloud(output_cloud)
+{
+}
+
+void stereoBatch::addPair(int pairId, const pmpConfig &pmpCfg, const stereoConfig &stereoCfg)
+{
+    pairContext &pair = pairs[pairId];
+    pair.phaseCal = make_shared<phaseCalculator>(pmpCfg);
+    pair.stereoPro = make_shared<stereoProcessor>(stereoCfg);
+}
+
+bool stereoBatch::popJob(vector<jobQueue> &queues, int worker, int &job)
+{
+    {
+        lock_guard<mutex> lock(queues[worker].mtx);
+        if (!queues[worker].jobs.empty())
+        {
+            job = queues[worker].jobs.front();
+            queues[worker].jobs.pop_front();
+            return true;
+        }
+    }
+    // Steal from the back of other queues. Jobs are never added while processing, so empty queues stay empty.
+    for (size_t k = 1; k < queues.size(); ++k)
+    {
+        jobQueue &victim = queues[(worker + k) % queues.size()];
+        lock_guard<mutex> lock(victim.mtx);
+        if (!victim.jobs.empty())
+        {
+            job = victim.jobs.back();
+            victim.jobs.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void stereoBatch::runJob(const stereoJob &job, stereoResult &result)
+{
+    map<int, pairContext>::iterator it = pairs.find(job.pairId);
+    if (it == pairs.end())
+    {
+        cout << "Camera pair is not registered!" << endl;
+        throw exception();
+    }
+
+    // Calculators are only read, so jobs of the same pair run concurrently.
+    phaseCalculator &phaseCal = *it->second.phaseCal;
+    stereoProcessor &stereoPro = *it->second.stereoPro;
+    Mat absPhase1, absPhase2;
+    phaseCal.calAbsPhaseDirect(job.stripImg1, absPhase1);
+    phaseCal.calAbsPhaseDirect(job.stripImg2, absPhase2);
+    // Rows are rectified on the fly, rectified phase maps are never stored.
+    result.disparity.create(stereoPro.imgSize, CV_TYPE);
+    stereoPro.calDisparityRows(absPhase1, 0, absPhase2, 0, 0, stereoPro.imgSize.height, &result.disparity, outputCloud ? &result.cloud : NULL);
+}
+
+void stereoBatch::process(const vector<stereoJob> &jobs, vector<stereoResult> &results)
+{
+    results.resize(jobs.size());
+    if (jobs.empty())
+        return;
+
+    int cores = omp_get_num_procs();
+    // More workers than cores would only oversubscribe them.
+    int workers = min(min(threads > 0 ? threads : cores, cores), (int)jobs.size());
+    // Cores left over by few jobs go to OpenMP inside each job. The first cores % workers workers get one more,
+    // so that every core is used.
+    int jobThreads = cores / workers, extraThreads = cores % workers;
+
+    // Jobs are dealt round-robin, stealing balances uneven jobs.
+    vector<jobQueue> queues(workers);
+    for (size_t k = 0; k < jobs.size(); ++k)
+        queues[k % workers].jobs.push_back(k);
+
+    mutex errorMtx;
+    exception_ptr error;
+    bool failed = false;
+    vector<thread> pool;
+    for (int w = 0; w < workers; ++w)
+        pool.push_back(thread([&, w] {
+            // Number of threads of OpenMP regions started by this worker.
+            omp_set_num_threads(jobThreads + (w < extraThreads ? 1 : 0));
+            int k;
+            while (popJob(queues, w, k))
+            {
+                {
+                    lock_guard<mutex> lock(errorMtx);
+                    if (failed)
+                        break;
+                }
+                try
+                {
+                    results[k].id = jobs[k].id;
+                    runJob(jobs[k], results[k]);
+                }
+                catch (...)
+                {
+                    lock_guard<mutex> lock(errorMtx);
+                    if (!failed)
+                        error = current_exception();
+                    failed = true;
+                }
+            }
+        }));
+    for (size_t w = 0; w < pool.size(); ++w)
+        pool[w].join();
+
+    if (error)
+        rethrow_exception(error);
+}
@@ -0,0 +1,61 @@
+#ifndef STEREO_BATCH
+#define STEREO_BATCH
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <exception>
+#include "stereoPipeline.h"
+
+// Strip images of one stereo pair to process in a batch.
+struct stereoJob
+{
+    int id;
+    // Camera pair registered by stereoBatch::addPair.
+    int pairId;
+    // Strip images of each camera. all frequencies in order, one N-step set each.
+    std::vector<cv::Mat> stripImg1;
+    std::vector<cv::Mat> stripImg2;
+};
+
+// Batch processing of many stereo pairs, e.g. multiple rigs or turntable positions.
+// Jobs are scheduled by one work-stealing scheduler. Each worker runs OpenMP regions of its job with
+// its share of cores, so stages never oversubscribe the machine.
+class stereoBatch
+{
+protected:
+    // Calculators of a camera pair, shared by all jobs of the pair. They have no workspace or instrument,
+    // since workers number their OpenMP threads from 0 and would share their per-thread slots.
+    struct pairContext
+    {
+        std::shared_ptr<phaseCalculator> phaseCal;
+        std::shared_ptr<stereoProcessor> stereoPro;
+    };
+    // Jobs of a worker. Owner pops from the front, thieves steal from the back.
+    struct jobQueue
+    {
+        std::mutex mtx;
+        std::deque<int> jobs;
+    };
+
+    std::map<int, pairContext> pairs;
+    // Worker threads, 0 for all cores. Clamped to the number of cores.
+    int threads;
+    // Reproject valid points of each job.
+    bool outputCloud;
+
+    // Take a job of worker, or steal one. Return false when all queues are empty.
+    bool popJob(std::vector<jobQueue> &queues, int worker, int &job);
+    void runJob(const stereoJob &job, stereoResult &result);
+
+public:
+    stereoBatch(int threads = 0, bool output_cloud = false);
+
+    // Register a camera pair. Calibration is loaded once and shared by all jobs of the pair.
+    void addPair(int pairId, const pmpConfig &pmpCfg, const stereoConfig &stereoCfg);
+    // Process jobs and return results in job order. The first error of any job is rethrown after workers stop.
+    void process(const std::vector<stereoJob> &jobs, std::vector<stereoResult> &results);
+};
+
+#endif
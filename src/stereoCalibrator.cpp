@@ -1,9 +1,22 @@
 #include "stereoCalibrator.h"
+#include <fstream>
+#include <cstring>
+#include <unistd.h>
 
 using namespace std;
 using namespace cv;
 
-stereoCalibrator::stereoCalibrator(cv::Size _boardSize, float _squareSize)
+// Corner cache layout.
+// header | entries of key (uint64), corner number (uint32), corners (float x, y)
+#define CORNER_CACHE_VERSION 1
+struct cornerCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+};
+
+stereoCalibrator::stereoCalibrator(cv::Size _boardSize, float _squareSize) : nextId(0)
 {
     updateCaliConfig(_boardSize, _squareSize);
 }
@@ -14,17 +27,91 @@ stereoCalibrator::~stereoCalibrator()
 
 void stereoCalibrator::updateCaliConfig(cv::Size _boardSize, float _squareSize)
 {
+    // Corners of the old board do not fit the new one. Cached corners are keyed by board size and stay.
+    if (_boardSize != boardSize)
+        clearPoses();
+
     // Update chessboard parameters.
     boardSize = _boardSize;
     squareSize = _squareSize;
 
     // Calculate chessboard coordinates.
+    objectPoints.clear();
     for (int i = 0; i < boardSize.height; i++)
         for (int j = 0; j < boardSize.width; j++)
             objectPoints.push_back(Point3f(j * squareSize, i * squareSize, 0));
 }
 
-void stereoCalibrator::calibrate(const std::vector<cv::Mat> &imgSet1, const std::vector<cv::Mat> &imgSet2, cv::Mat &K1, cv::Mat &D1, cv::Mat &K2, cv::Mat &D2, cv::Mat &R, cv::Mat &T, cv::Mat &F, cv::Mat &E) const
+uint64_t stereoCalibrator::imageKey(const Mat &img) const
+{
+    // FNV-1a over board size, image size and type, and pixels.
+    uint64_t h = 14695981039346656037ULL;
+    int info[5] = {boardSize.width, boardSize.height, img.cols, img.rows, img.type()};
+    const unsigned char *p = (const unsigned char *)info;
+    for (size_t i = 0; i < sizeof(info); ++i)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    size_t rowBytes = img.cols * img.elemSize();
+    for (int r = 0; r < img.rows; ++r)
+    {
+        p = img.ptr<unsigned char>(r);
+        for (size_t i = 0; i < rowBytes; ++i)
+            h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+bool stereoCalibrator::findCorners(const Mat &img, vector<Point2f> &corners) const
+{
+    uint64_t key = imageKey(img);
+    bool cached = false;
+#pragma omp critical(cornerCache)
+    {
+        map<uint64_t, vector<Point2f>>::const_iterator it = cornerCache.find(key);
+        if (it != cornerCache.end())
+        {
+            corners = it->second;
+            cached = true;
+        }
+    }
+    if (cached)
+        return !corners.empty();
+
+    // Finding checker board corners
+    // If desired number of corners are found in the image then found = true
+    corners.clear();
+    bool found = findChessboardCorners(img, boardSize, corners, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FAST_CHECK | CV_CALIB_CB_NORMALIZE_IMAGE);
+    if (found)
+    {
+        TermCriteria criteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.001);
+        // Refining pixel coordinates for given 2d points.
+        cornerSubPix(img, corners, Size(11, 11), Size(-1, -1), criteria);
+    }
+    else
+        corners.clear();
+
+#pragma omp critical(cornerCache)
+    cornerCache[key] = corners;
+    return found;
+}
+
+void stereoCalibrator::findCornerPairs(const vector<Mat> &imgSet1, const vector<Mat> &imgSet2, vector<vector<Point2f>> &corners1, vector<vector<Point2f>> &corners2, vector<bool> &found) const
+{
+    int n = imgSet1.size();
+    corners1.assign(n, vector<Point2f>());
+    corners2.assign(n, vector<Point2f>());
+    vector<char> pairFound(n);
+    // Detection time varies a lot between images, pairs are handed out one by one.
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n; i++)
+    {
+        bool found1 = findCorners(imgSet1[i], corners1[i]);
+        bool found2 = findCorners(imgSet2[i], corners2[i]);
+        pairFound[i] = found1 & found2;
+    }
+    found.assign(pairFound.begin(), pairFound.end());
+}
+
+void stereoCalibrator::checkImgSet(const vector<Mat> &imgSet1, const vector<Mat> &imgSet2)
 {
     if(imgSet1.empty() | imgSet2.empty())
     {
@@ -36,31 +123,174 @@ void stereoCalibrator::calibrate(const std::vector<cv::Mat> &imgSet1, const std:
         cout << "Different number of calibration images!" << endl;
         throw exception();
     }
+    // Corners are found in a parallel loop, which must not throw, so every image is checked here.
+    for (size_t i = 0; i < imgSet1.size(); i++)
+        for (const Mat *img : {&imgSet1[i], &imgSet2[i]})
+        {
+            if (img->empty() || img->type() != CV_8UC1)
+            {
+                cout << "Calibration images must be non-empty CV_8UC1!" << endl;
+                throw exception();
+            }
+            if (img->size() != imgSet1[0].size())
+            {
+                cout << "Calibration images of different size!" << endl;
+                throw exception();
+            }
+        }
+}
+
+void stereoCalibrator::calibrate(const std::vector<cv::Mat> &imgSet1, const std::vector<cv::Mat> &imgSet2, cv::Mat &K1, cv::Mat &D1, cv::Mat &K2, cv::Mat &D2, cv::Mat &R, cv::Mat &T, cv::Mat &F, cv::Mat &E) const
+{
+    checkImgSet(imgSet1, imgSet2);
 
     // Find corners.
-    bool found1, found2;
+    vector<vector<Point2f>> corners1, corners2;
+    vector<bool> found;
+    findCornerPairs(imgSet1, imgSet2, corners1, corners2, found);
     vector<vector<Point3f>> objectPointsSet;
     vector<vector<Point2f>> imgPoints1, imgPoints2;
-    for (int i = 0; i < imgSet1.size(); i++)
+    for (size_t i = 0; i < found.size(); i++)
+        if (found[i])
+        {
+            objectPointsSet.push_back(objectPoints);
+            imgPoints1.push_back(corners1[i]);
+            imgPoints2.push_back(corners2[i]);
+        }
+    stereoCalibrate(objectPointsSet, imgPoints1, imgPoints2, K1, D1, K2, D2, imgSet1[0].size(), R, T, E, F);
+}
+
+vector<int> stereoCalibrator::addPoses(const vector<Mat> &imgSet1, const vector<Mat> &imgSet2)
+{
+    checkImgSet(imgSet1, imgSet2);
+    if (!poses.empty() && imgSet1[0].size() != imgSize)
     {
-        vector<Point2f> cornerPoints1, cornerPoints2;
-        // Finding checker board corners
-        // If desired number of corners are found in the image then found = true
-        found1 = findChessboardCorners(imgSet1[i], boardSize, cornerPoints1, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FAST_CHECK | CV_CALIB_CB_NORMALIZE_IMAGE);
-        found2 = findChessboardCorners(imgSet2[i], boardSize, cornerPoints2, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FAST_CHECK | CV_CALIB_CB_NORMALIZE_IMAGE);
+        cout << "Calibration images of different size!" << endl;
+        throw exception();
+    }
+    imgSize = imgSet1[0].size();
 
-        if (found1 & found2)
+    vector<vector<Point2f>> corners1, corners2;
+    vector<bool> found;
+    findCornerPairs(imgSet1, imgSet2, corners1, corners2, found);
+    vector<int> ids(found.size(), -1);
+    for (size_t i = 0; i < found.size(); i++)
+        if (found[i])
         {
-            TermCriteria criteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.001);
-            // Refining pixel coordinates for given 2d points.
-            cornerSubPix(imgSet1[i], cornerPoints1, Size(11, 11), Size(-1, -1), criteria);
-            cornerSubPix(imgSet2[i], cornerPoints2, Size(11, 11), Size(-1, -1), criteria);
+            pose p;
+            p.id = ids[i] = nextId++;
+            p.corners1.swap(corners1[i]);
+            p.corners2.swap(corners2[i]);
+            poses.push_back(p);
+        }
+    return ids;
+}
 
-            objectPointsSet.push_back(objectPoints);
+int stereoCalibrator::addPose(const Mat &img1, const Mat &img2)
+{
+    return addPoses(vector<Mat>(1, img1), vector<Mat>(1, img2))[0];
+}
 
-            imgPoints1.push_back(cornerPoints1);
-            imgPoints2.push_back(cornerPoints2);
+bool stereoCalibrator::removePose(int id)
+{
+    for (size_t i = 0; i < poses.size(); i++)
+        if (poses[i].id == id)
+        {
+            poses.erase(poses.begin() + i);
+            return true;
         }
+    return false;
+}
+
+void stereoCalibrator::clearPoses()
+{
+    poses.clear();
+}
+
+int stereoCalibrator::poseNum() const
+{
+    return poses.size();
+}
+
+void stereoCalibrator::solve(cv::Mat &K1, cv::Mat &D1, cv::Mat &K2, cv::Mat &D2, cv::Mat &R, cv::Mat &T, cv::Mat &F, cv::Mat &E) const
+{
+    if (poses.empty())
+    {
+        cout << "None calibration poses!" << endl;
+        throw exception();
     }
-    stereoCalibrate(objectPointsSet, imgPoints1, imgPoints2, K1, D1, K2, D2, imgSet1[0].size(), R, T, E, F);
-}
\ No newline at end of file
+
+    vector<vector<Point3f>> objectPointsSet(poses.size(), objectPoints);
+    vector<vector<Point2f>> imgPoints1(poses.size()), imgPoints2(poses.size());
+    for (size_t i = 0; i < poses.size(); i++)
+    {
+        imgPoints1[i] = poses[i].corners1;
+        imgPoints2[i] = poses[i].corners2;
+    }
+    stereoCalibrate(objectPointsSet, imgPoints1, imgPoints2, K1, D1, K2, D2, imgSize, R, T, E, F);
+}
+
+bool stereoCalibrator::loadCornerCache(const string &path)
+{
+    ifstream file(path, ios::in | ios::binary);
+    if (file.fail())
+        return false;
+    cornerCacheHeader header;
+    file.read((char *)&header, sizeof(header));
+    if (file.fail() || memcmp(header.magic, "PMPCORN", 8) != 0 || header.version != CORNER_CACHE_VERSION)
+        return false;
+
+    // Entries are merged into cache only if the whole file is read.
+    map<uint64_t, vector<Point2f>> entries;
+    for (uint32_t k = 0; k < header.count; ++k)
+    {
+        uint64_t key;
+        uint32_t n;
+        file.read((char *)&key, sizeof(key));
+        file.read((char *)&n, sizeof(n));
+        if (file.fail() || n > (uint32_t)boardSize.area() * 64)
+            return false;
+        vector<Point2f> &corners = entries[key];
+        corners.resize(n);
+        if (n)
+            file.read((char *)&corners[0], n * sizeof(Point2f));
+        if (file.fail())
+            return false;
+    }
+    for (map<uint64_t, vector<Point2f>>::iterator it = entries.begin(); it != entries.end(); ++it)
+        cornerCache[it->first].swap(it->second);
+    return true;
+}
+
+void stereoCalibrator::saveCornerCache(const string &path) const
+{
+    cornerCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PMPCORN", 8);
+    header.version = CORNER_CACHE_VERSION;
+    header.count = cornerCache.size();
+
+    // Write to a temporary file and rename, so other processes never see a partial cache.
+    string tmpPath = path + ".tmp" + to_string(getpid());
+    ofstream file(tmpPath, ios::out | ios::binary);
+    if (file.fail())
+    {
+        cout << "Can't write corner cache!" << endl;
+        return;
+    }
+    file.write((const char *)&header, sizeof(header));
+    for (map<uint64_t, vector<Point2f>>::const_iterator it = cornerCache.begin(); it != cornerCache.end(); ++it)
+    {
+        uint32_t n = it->second.size();
+        file.write((const char *)&it->first, sizeof(it->first));
+        file.write((const char *)&n, sizeof(n));
+        if (n)
+            file.write((const char *)&it->second[0], n * sizeof(Point2f));
+    }
+    file.close();
+    if (file.fail() || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        cout << "Can't write corner cache!" << endl;
+        remove(tmpPath.c_str());
+    }
+}
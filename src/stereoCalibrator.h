@@ -1,21 +1,63 @@
 #ifndef STEREO_CALIBRATOR
 #define STEREO_CALIBRATOR
 
+#include <map>
 #include <vector>
 #include <string>
+#include <cstdint>
 #include <opencv2/opencv.hpp>
 
 class stereoCalibrator
 {
 private:
+    // Chessboard corners of both cameras in one pose.
+    struct pose
+    {
+        int id;
+        std::vector<cv::Point2f> corners1, corners2;
+    };
+
     std::vector<cv::Point3f> objectPoints;
     cv::Size boardSize;
     float squareSize;
 
+    // Corners of every image detected so far, keyed by imageKey. Empty if the board is not found.
+    mutable std::map<uint64_t, std::vector<cv::Point2f>> cornerCache;
+    // Poses of incremental calibration.
+    std::vector<pose> poses;
+    cv::Size imgSize;
+    int nextId;
+
+    // Hash of image content and board size.
+    uint64_t imageKey(const cv::Mat &img) const;
+    // Detect and refine corners, or take them from cache. Return false if the board is not found.
+    bool findCorners(const cv::Mat &img, std::vector<cv::Point2f> &corners) const;
+    // Find corners of image pairs in parallel. found[i] is true if the board is found in both images.
+    void findCornerPairs(const std::vector<cv::Mat> &imgSet1, const std::vector<cv::Mat> &imgSet2, std::vector<std::vector<cv::Point2f>> &corners1, std::vector<std::vector<cv::Point2f>> &corners2, std::vector<bool> &found) const;
+    // Check that image sets are not empty and of the same number, and that every image is non-empty CV_8UC1 of one size.
+    static void checkImgSet(const std::vector<cv::Mat> &imgSet1, const std::vector<cv::Mat> &imgSet2);
+
 public:
     stereoCalibrator(cv::Size _boardSize, float _squareSize);
     ~stereoCalibrator();
+    // Update chessboard parameters. Poses of the old board are removed.
     void updateCaliConfig(cv::Size _boardSize, float _squareSize);
     void calibrate(const std::vector<cv::Mat> &imgSet1, const std::vector<cv::Mat> &imgSet2, cv::Mat &K1, cv::Mat &D1, cv::Mat &K2, cv::Mat &D2, cv::Mat &R, cv::Mat &T, cv::Mat &F, cv::Mat &E) const;
+
+    // Incremental calibration. Poses are kept between solves, so adding one pose only detects its corners.
+    // Add image pairs as poses, detecting corners in parallel. Return id of each pose, -1 if the board is not found in both images.
+    std::vector<int> addPoses(const std::vector<cv::Mat> &imgSet1, const std::vector<cv::Mat> &imgSet2);
+    int addPose(const cv::Mat &img1, const cv::Mat &img2);
+    // Remove a pose by id. Return false if there is no such pose.
+    bool removePose(int id);
+    void clearPoses();
+    int poseNum() const;
+    // Calibrate with current poses.
+    void solve(cv::Mat &K1, cv::Mat &D1, cv::Mat &K2, cv::Mat &D2, cv::Mat &R, cv::Mat &T, cv::Mat &F, cv::Mat &E) const;
+
+    // Persistent corner cache. Images seen before, in any pose or calibration, skip detection.
+    // Load cache file. Return false if the file is missing or of another version.
+    bool loadCornerCache(const std::string &path);
+    void saveCornerCache(const std::string &path) const;
 };
-#endif
\ No newline at end of file
+#endif
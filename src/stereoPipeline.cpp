@@ -0,0 +1,198 @@
+#include "stereoPipeline.h"
+
+using namespace std;
+using namespace cv;
+
+stereoPipeline::stereoPipeline(phaseCalculator &phase_cal, stereoProcessor &stereo_pro, function<void(stereoResult &)> callback, int queue_size, bool output_cloud) : phaseCal(phase_cal),
+                                                                                                                                                stereoPro(stereo_pro),
+                                                                                                                                                callback(callback),
+                                                                                                                                                queueSize(queue_size > 0 ? queue_size : 1),
+                                                                                                                                                outputCloud(output_cloud),
+                                                                                                                                                stageThreads(max(omp_get_num_procs() / 2, 1)),
+                                                                                                                                                copying(0),
+                                                                                                                                                stopping(false),
+                                                                                                                                                phaseDone(false),
+                                                                                                                                                pushed(0),
+                                                                                                                                                delivered(0)
+{
+    // Stage teams run at the same time and both number their threads from 0, so they would share scratch slots.
+    if (phaseCal.getWorkspace() && phaseCal.getWorkspace() == stereoPro.getWorkspace())
+    {
+        cout << "Stages of pipeline must not share a workspace!" << endl;
+        throw exception();
+    }
+    if (phaseCal.getInstrument() && phaseCal.getInstrument() == stereoPro.getInstrument())
+    {
+        cout << "Stages of pipeline must not share an instrument!" << endl;
+        throw exception();
+    }
+    phaseThread = thread(&stereoPipeline::phaseLoop, this);
+    matchThread = thread(&stereoPipeline::matchLoop, this);
+}
+
+stereoPipeline::~stereoPipeline()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+    frameCond.notify_all();
+    phaseCond.notify_all();
+    phaseThread.join();
+    matchThread.join();
+}
+
+void stereoPipeline::push(const stereoFrame &frame)
+{
+    stereoFrame copy;
+    {
+        unique_lock<mutex> lock(mtx);
+        frameCond.wait(lock, [this] { return frameQueue.size() + copying < queueSize || error; });
+        checkError();
+        // Reuse buffers of a frame done by phase stage.
+        if (!freeFrames.empty())
+        {
+            copy = freeFrames.front();
+            freeFrames.pop_front();
+        }
+        ++copying;
+    }
+
+    // Copy outside the lock, copyTo keeps buffers of the same size and type.
+    copy.id = frame.id;
+    copy.stripImg1.resize(frame.stripImg1.size());
+    copy.stripImg2.resize(frame.stripImg2.size());
+    for (size_t k = 0; k < frame.stripImg1.size(); ++k)
+        frame.stripImg1[k].copyTo(copy.stripImg1[k]);
+    for (size_t k = 0; k < frame.stripImg2.size(); ++k)
+        frame.stripImg2[k].copyTo(copy.stripImg2[k]);
+
+    {
+        lock_guard<mutex> lock(mtx);
+        --copying;
+        frameQueue.push_back(copy);
+        ++pushed;
+    }
+    frameCond.notify_all();
+}
+
+void stereoPipeline::flush()
+{
+    unique_lock<mutex> lock(mtx);
+    doneCond.wait(lock, [this] { return delivered == pushed || error; });
+    checkError();
+}
+
+void stereoPipeline::phaseLoop()
+{
+    omp_set_num_threads(stageThreads);
+    while (true)
+    {
+        stereoFrame frame;
+        phaseFrame phase;
+        {
+            unique_lock<mutex> lock(mtx);
+            frameCond.wait(lock, [this] { return !frameQueue.empty() || stopping || error; });
+            if (frameQueue.empty() || error)
+                break;
+            frame = frameQueue.front();
+            frameQueue.pop_front();
+            // Reuse buffers of a delivered frame.
+            if (!freePhase.empty())
+            {
+                phase = freePhase.front();
+                freePhase.pop_front();
+            }
+        }
+        frameCond.notify_all();
+
+        try
+        {
+            phase.id = frame.id;
+            phaseCal.calAbsPhaseDirect(frame.stripImg1, phase.absPhase1);
+            phaseCal.calAbsPhaseDirect(frame.stripImg2, phase.absPhase2);
+        }
+        catch (...)
+        {
+            setError();
+            break;
+        }
+
+        {
+            unique_lock<mutex> lock(mtx);
+            phaseCond.wait(lock, [this] { return phaseQueue.size() < 2 || error; });
+            if (error)
+                break;
+            phaseQueue.push_back(phase);
+            freeFrames.push_back(frame);
+        }
+        phaseCond.notify_all();
+    }
+
+    {
+        lock_guard<mutex> lock(mtx);
+        phaseDone = true;
+    }
+    phaseCond.notify_all();
+}
+
+void stereoPipeline::matchLoop()
+{
+    omp_set_num_threads(stageThreads);
+    // Callback runs in this thread before the next frame, so one result is reused by every frame.
+    stereoResult result;
+    while (true)
+    {
+        phaseFrame phase;
+        {
+            unique_lock<mutex> lock(mtx);
+            phaseCond.wait(lock, [this] { return !phaseQueue.empty() || phaseDone || error; });
+            if (phaseQueue.empty() || error)
+                break;
+            phase = phaseQueue.front();
+            phaseQueue.pop_front();
+        }
+        phaseCond.notify_all();
+
+        try
+        {
+            result.id = phase.id;
+            stereoPro.rectifyPhase(phase.absPhase1, phase.absPhase2, rectPhase1, rectPhase2);
+            if (outputCloud)
+                stereoPro.calDisparity(rectPhase1, rectPhase2, result.disparity, result.cloud);
+            else
+                stereoPro.calDisparity(rectPhase1, rectPhase2, result.disparity);
+            callback(result);
+        }
+        catch (...)
+        {
+            setError();
+            break;
+        }
+
+        {
+            lock_guard<mutex> lock(mtx);
+            freePhase.push_back(phase);
+            ++delivered;
+        }
+        doneCond.notify_all();
+    }
+}
+
+void stereoPipeline::setError()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (!error)
+            error = current_exception();
+    }
+    frameCond.notify_all();
+    phaseCond.notify_all();
+    doneCond.notify_all();
+}
+
+void stereoPipeline::checkError()
+{
+    if (error)
+        rethrow_exception(error);
+}
@@ -0,0 +1,96 @@
+#ifndef STEREO_PIPELINE
+#define STEREO_PIPELINE
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+#include "phaseCalculator.h"
+#include "stereoProcessor.h"
+
+// Strip images of one stereo frame.
+struct stereoFrame
+{
+    int id;
+    // Strip images of each camera. all frequencies in order, one N-step set each.
+    std::vector<cv::Mat> stripImg1;
+    std::vector<cv::Mat> stripImg2;
+};
+
+// Result of one stereo frame.
+struct stereoResult
+{
+    int id;
+    cv::Mat disparity;
+    // Valid points, filled if the pipeline outputs point cloud.
+    pointCloud cloud;
+};
+
+// Streaming pipeline. Phase calculation of frame N + 1 runs while frame N is rectified and matched.
+class stereoPipeline
+{
+protected:
+    // Absolute phase of both cameras, passed from phase stage to match stage.
+    struct phaseFrame
+    {
+        int id;
+        cv::Mat absPhase1;
+        cv::Mat absPhase2;
+    };
+
+    phaseCalculator &phaseCal;
+    stereoProcessor &stereoPro;
+    std::function<void(stereoResult &)> callback;
+    // Max frames waiting for phase stage.
+    size_t queueSize;
+    // Reproject valid points in match stage.
+    bool outputCloud;
+    // OpenMP threads of each stage. Stages run at the same time, so each gets half of the cores.
+    int stageThreads;
+
+    // Frames waiting for phase stage. Images are copies owned by the pipeline.
+    std::deque<stereoFrame> frameQueue;
+    // Frame buffers released by phase stage, reused by push.
+    std::deque<stereoFrame> freeFrames;
+    // Frames being copied by push, counted against queueSize.
+    size_t copying;
+    // Phase maps waiting for match stage. Double buffered.
+    std::deque<phaseFrame> phaseQueue;
+    // Phase buffers returned by match stage, reused by phase stage.
+    std::deque<phaseFrame> freePhase;
+    // Rectified phase maps of match stage.
+    cv::Mat rectPhase1, rectPhase2;
+
+    std::mutex mtx;
+    std::condition_variable frameCond, phaseCond, doneCond;
+    std::thread phaseThread, matchThread;
+    bool stopping;
+    bool phaseDone;
+    long pushed, delivered;
+    // First error thrown by a stage, rethrown by push and flush.
+    std::exception_ptr error;
+
+    void phaseLoop();
+    void matchLoop();
+    void setError();
+    void checkError();
+
+public:
+    // Constructor. Objects are used by stage threads and must not be used elsewhere while the pipeline runs.
+    // phase_cal and stereo_pro run concurrently and need a workspace and an instrument each, sharing one throws.
+    // Buffers of the result passed to callback are reused by the next frame. Clone or swap them out to keep them.
+    stereoPipeline(phaseCalculator &phase_cal, stereoProcessor &stereo_pro, std::function<void(stereoResult &)> callback, int queue_size = 2, bool output_cloud = false);
+    // Destructor. Process remaining frames and stop stage threads.
+    ~stereoPipeline();
+
+    // Push a frame. Block when the queue is full. Images are copied into recycled buffers,
+    // so the caller may reuse them, e.g. for the next acquisition, as soon as push returns.
+    void push(const stereoFrame &frame);
+    // Wait until all pushed frames are delivered.
+    void flush();
+};
+
+#endif
@@ -1,31 +1,112 @@
 #include "stereoProcessor.h"
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 using namespace cv;
 
-stereoConfig::stereoConfig(cv::Size img_size, TYPE disparity_th, TYPE match_th, std::string file_path) : imgSize(img_size),
-                                                                                                         disparityTH(disparity_th),
-                                                                                                         matchTH(match_th),
-                                                                                                         filePath(file_path)
+// Reverse match of a right pixel not searched yet. Valid matches are >= 0 and missing ones NaN.
+#define LR_UNSEARCHED -2
+
+stereoConfig::stereoConfig(cv::Size img_size, TYPE disparity_th, TYPE match_th, std::string file_path, int search_mode) : imgSize(img_size),
+                                                                                                                          disparityTH(disparity_th),
+                                                                                                                          matchTH(match_th),
+                                                                                                                          phaseScale(0),
+                                                                                                                          filePath(file_path),
+                                                                                                                          searchMode(search_mode),
+                                                                                                                          lrCheck(false),
+                                                                                                                          lrTH(1)
 {
 }
 
-stereoProcessor::stereoProcessor(const stereoConfig &cfg)
+stereoProcessor::stereoProcessor(const stereoConfig &cfg) : workspace(NULL),
+                                                            instrument(NULL),
+                                                            mask(NULL)
 {
     updateConfig(cfg);
-    if (cfg.filePath != "")
-        calRectifyMap();
 }
 
 stereoProcessor::~stereoProcessor() {}
 
+void stereoProcessor::setWorkspace(pmpWorkspace *ws)
+{
+    workspace = ws;
+}
+
+pmpWorkspace *stereoProcessor::getWorkspace() const
+{
+    return workspace;
+}
+
+void stereoProcessor::setInstrument(pmpInstrument *ins)
+{
+    instrument = ins;
+}
+
+pmpInstrument *stereoProcessor::getInstrument() const
+{
+    return instrument;
+}
+
+void stereoProcessor::setMask(const spanMask *m)
+{
+    if (m && m->getSize() != imgSize)
+    {
+        cout << "Mask must be of the size of images!" << endl;
+        throw exception();
+    }
+    mask = m;
+}
+
+void stereoProcessor::rectifyMask(const spanMask &cameraMask, spanMask &rectMask) const
+{
+    if (map11.empty())
+    {
+        cout << "Rectification map is empty!" << endl;
+        throw exception();
+    }
+    if (cameraMask.getSize() != imgSize)
+    {
+        cout << "Mask must be of the size of images!" << endl;
+        throw exception();
+    }
+
+    Mat cameraMap;
+    cameraMask.toMat(cameraMap);
+    vector<vector<int>> rowSpans(imgSize.height);
+#pragma omp parallel for
+    for (int i = 0; i < imgSize.height; ++i)
+    {
+        const short *xy = map11.ptr<short>(i);
+        const ushort *frac = map12.ptr<ushort>(i);
+        // A rectified pixel is in mask if its nearest source pixel is, as rectifyPhaseRow decides validity.
+        appendSpans(imgSize.width, [&](int j) {
+            int x = xy[2 * j] + ((frac[j] & (INTER_TAB_SIZE - 1)) >= INTER_TAB_SIZE / 2);
+            int y = xy[2 * j + 1] + ((frac[j] >> INTER_BITS) >= INTER_TAB_SIZE / 2);
+            return x >= 0 && x < imgSize.width && y >= 0 && y < imgSize.height && cameraMap.ptr<uchar>(y)[x];
+        },
+                    rowSpans[i]);
+    }
+    rectMask.build(imgSize, rowSpans);
+}
+
 void stereoProcessor::updateConfig(const stereoConfig &cfg)
 {
     imgSize = cfg.imgSize;
     matchTH = cfg.matchTH;
+    phaseScale = cfg.phaseScale;
+    searchMode = cfg.searchMode;
+    lrCheck = cfg.lrCheck;
+    lrTH = cfg.lrTH;
     disparityTH = cfg.disparityTH;
     ROI1 = cfg.ROI1;
     ROI2 = cfg.ROI2;
+    cachePath = cfg.cachePath;
 
     if (cfg.filePath != "")
         loadCaliResult(cfg.filePath);
@@ -95,18 +176,311 @@ void stereoProcessor::loadCaliResult(string filePath)
             caliResult >> E.at<double>(i, j);
 
     caliResult.close();
-    calRectifyMap();
+
+    // Load rectification maps from cache, or calculate and cache them.
+    if (cachePath == "")
+        calRectifyMap();
+    else
+    {
+        uint64_t key = caliHash();
+        if (!loadRectifyCache(cachePath, key))
+        {
+            calRectifyMap();
+            saveRectifyCache(cachePath, key);
+        }
+    }
+}
+
+// Rectification cache layout. Blocks are aligned to RECTIFY_CACHE_ALIGN bytes.
+// header | R1 R2 P1 P2 Q (doubles) | map11 | map12 | map21 | map22
+#define RECTIFY_CACHE_VERSION 1
+#define RECTIFY_CACHE_ALIGN 64
+struct rectifyCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t typeSize;
+    uint64_t key;
+    int32_t width, height;
+    int32_t roi[8];
+    double R1[9], R2[9], P1[12], P2[12], Q[16];
+};
+
+static size_t alignUp(size_t n)
+{
+    return (n + RECTIFY_CACHE_ALIGN - 1) / RECTIFY_CACHE_ALIGN * RECTIFY_CACHE_ALIGN;
+}
+
+uint64_t stereoProcessor::caliHash() const
+{
+    // FNV-1a over image size and calibration parameters.
+    uint64_t h = 14695981039346656037ULL;
+    int size[3] = {imgSize.width, imgSize.height, RECTIFY_CACHE_VERSION};
+    const unsigned char *p = (const unsigned char *)size;
+    for (size_t i = 0; i < sizeof(size); ++i)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    const Mat *mats[6] = {&K1, &D1, &K2, &D2, &R, &T};
+    for (int m = 0; m < 6; ++m)
+    {
+        p = mats[m]->ptr<unsigned char>(0);
+        for (size_t i = 0; i < mats[m]->total() * mats[m]->elemSize(); ++i)
+            h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+bool stereoProcessor::loadRectifyCache(const string &path, uint64_t key)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(rectifyCacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+    size_t fileSize = st.st_size;
+    void *addr = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return false;
+    shared_ptr<void> mapping(addr, [fileSize](void *a) { munmap(a, fileSize); });
+
+    const rectifyCacheHeader *header = (const rectifyCacheHeader *)addr;
+    size_t pixels = (size_t)imgSize.width * imgSize.height;
+    size_t offset = alignUp(sizeof(rectifyCacheHeader));
+    size_t map1Size = alignUp(pixels * 2 * sizeof(short)), map2Size = alignUp(pixels * sizeof(ushort));
+    if (memcmp(header->magic, "PMPRECT", 8) != 0 || header->version != RECTIFY_CACHE_VERSION || header->typeSize != sizeof(TYPE) ||
+        header->key != key || header->width != imgSize.width || header->height != imgSize.height ||
+        fileSize != offset + 2 * (map1Size + map2Size))
+        return false;
+
+    // Small matrices are copied, maps point into the mapping.
+    Mat(3, 3, CV_64FC1, (void *)header->R1).copyTo(R1);
+    Mat(3, 3, CV_64FC1, (void *)header->R2).copyTo(R2);
+    Mat(3, 4, CV_64FC1, (void *)header->P1).copyTo(P1);
+    Mat(3, 4, CV_64FC1, (void *)header->P2).copyTo(P2);
+    Mat(4, 4, CV_64FC1, (void *)header->Q).copyTo(Q);
+    ROI1 = Rect(header->roi[0], header->roi[1], header->roi[2], header->roi[3]);
+    ROI2 = Rect(header->roi[4], header->roi[5], header->roi[6], header->roi[7]);
+
+    char *base = (char *)addr;
+    map11 = Mat(imgSize, CV_16SC2, base + offset);
+    map12 = Mat(imgSize, CV_16UC1, base + offset + map1Size);
+    map21 = Mat(imgSize, CV_16SC2, base + offset + map1Size + map2Size);
+    map22 = Mat(imgSize, CV_16UC1, base + offset + 2 * map1Size + map2Size);
+    cacheMapping = mapping;
+    return true;
+}
+
+void stereoProcessor::saveRectifyCache(const string &path, uint64_t key) const
+{
+    rectifyCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "PMPRECT", 8);
+    header.version = RECTIFY_CACHE_VERSION;
+    header.typeSize = sizeof(TYPE);
+    header.key = key;
+    header.width = imgSize.width;
+    header.height = imgSize.height;
+    int roi[8] = {ROI1.x, ROI1.y, ROI1.width, ROI1.height, ROI2.x, ROI2.y, ROI2.width, ROI2.height};
+    memcpy(header.roi, roi, sizeof(roi));
+    memcpy(header.R1, R1.ptr<double>(0), sizeof(header.R1));
+    memcpy(header.R2, R2.ptr<double>(0), sizeof(header.R2));
+    memcpy(header.P1, P1.ptr<double>(0), sizeof(header.P1));
+    memcpy(header.P2, P2.ptr<double>(0), sizeof(header.P2));
+    memcpy(header.Q, Q.ptr<double>(0), sizeof(header.Q));
+
+    // Write to a temporary file and rename, so other processes never see a partial cache.
+    string tmpPath = path + ".tmp" + to_string(getpid());
+    ofstream file(tmpPath, ios::out | ios::binary);
+    if (file.fail())
+    {
+        cout << "Can't write rectification cache!" << endl;
+        return;
+    }
+    vector<char> pad(RECTIFY_CACHE_ALIGN, 0);
+    file.write((const char *)&header, sizeof(header));
+    file.write(&pad[0], alignUp(sizeof(header)) - sizeof(header));
+    const Mat *maps[4] = {&map11, &map12, &map21, &map22};
+    for (int m = 0; m < 4; ++m)
+    {
+        size_t rowBytes = maps[m]->cols * maps[m]->elemSize();
+        for (int i = 0; i < maps[m]->rows; ++i)
+            file.write(maps[m]->ptr<char>(i), rowBytes);
+        size_t bytes = rowBytes * maps[m]->rows;
+        file.write(&pad[0], alignUp(bytes) - bytes);
+    }
+    file.close();
+    if (file.fail() || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        cout << "Can't write rectification cache!" << endl;
+        remove(tmpPath.c_str());
+    }
 }
 
 void stereoProcessor::rectifyRemap(const Mat &src1, const Mat &src2, Mat &dst1, Mat &dst2)
 {
-    // Remap phase images.
-    remap(src1, dst1, map11, map12, INTER_LINEAR, BORDER_CONSTANT);
-    remap(src2, dst2, map21, map22, INTER_LINEAR, BORDER_CONSTANT);
+    if (!mask)
+    {
+        // Remap phase images.
+        remap(src1, dst1, map11, map12, INTER_LINEAR, BORDER_CONSTANT);
+        remap(src2, dst2, map21, map22, INTER_LINEAR, BORDER_CONSTANT);
+        return;
+    }
+
+    // Camera 1 in bounding box of mask, camera 2 in rows of the box, where matches are searched.
+    Rect box = mask->boundingRect();
+    Rect rows(0, box.y, imgSize.width, box.height);
+    dst1.create(imgSize, src1.type());
+    dst2.create(imgSize, src2.type());
+    dst1.setTo(Scalar(0));
+    dst2.setTo(Scalar(0));
+    if (box.empty())
+        return;
+    Mat roi1 = dst1(box), roi2 = dst2(rows);
+    remap(src1, roi1, map11(box), map12(box), INTER_LINEAR, BORDER_CONSTANT);
+    remap(src2, roi2, map21(rows), map22(rows), INTER_LINEAR, BORDER_CONSTANT);
+
+    // Clear pixels of the box out of mask.
+    size_t elemSize = dst1.elemSize();
+#pragma omp parallel for
+    for (int i = box.y; i < box.y + box.height; ++i)
+    {
+        uchar *dst = dst1.ptr<uchar>(i);
+        const int *spans = mask->rowSpans(i);
+        int j = box.x;
+        for (int s = 0; s < mask->spanNum(i); ++s)
+        {
+            memset(dst + j * elemSize, 0, (spans[2 * s] - j) * elemSize);
+            j = spans[2 * s + 1];
+        }
+        memset(dst + j * elemSize, 0, (box.x + box.width - j) * elemSize);
+    }
+}
+
+void stereoProcessor::rectifyPhase(const Mat &absPhase1, const Mat &absPhase2, Mat &dst1, Mat &dst2)
+{
+    PMP_CALL(instrument);
+    if (map11.empty() | map21.empty())
+    {
+        cout << "Rectification map is empty!" << endl;
+        throw exception();
+    }
+    checkPhase(absPhase1, absPhase2);
+
+    int type = absPhase1.type();
+    dst1.create(imgSize, type);
+    dst2.create(imgSize, type);
+#pragma omp parallel for
+    for (int i = 0; i < imgSize.height; ++i)
+    {
+        PMP_ROWS(instrument, STAGE_RECTIFY, 1);
+        if (type == CV_16UC1)
+            rectifyPhaseRows(absPhase1, 0, absPhase2, 0, i, dst1.ptr<ushort>(i), dst2.ptr<ushort>(i));
+        else
+            rectifyPhaseRows(absPhase1, 0, absPhase2, 0, i, dst1.ptr<TYPE>(i), dst2.ptr<TYPE>(i));
+    }
+}
+
+// Load and store phase of rectification. Fixed-point phase is interpolated in codes.
+static inline TYPE loadPhase(const TYPE *src, int j)
+{
+    return src[j];
+}
+
+static inline TYPE loadPhase(const ushort *src, int j)
+{
+    return (src[j] == PHASE_INVALID) ? NAN : src[j];
+}
+
+static inline void storePhase(TYPE *dst, int j, TYPE v)
+{
+    dst[j] = v;
+}
+
+static inline void storePhase(ushort *dst, int j, TYPE v)
+{
+    dst[j] = isnan(v) ? PHASE_INVALID : (ushort)(v + (TYPE)0.5);
+}
+
+template <typename P>
+void stereoProcessor::rectifyPhaseRow(const Mat &src, int srcRow, const Mat &map1, const Mat &map2, int row, P *dst, int j0, int j1)
+{
+    // map1 holds integer source coordinates, map2 holds the index of fractional part.
+    // Row t of src holds image row srcRow + t.
+    const short *xy = map1.ptr<short>(row);
+    const ushort *frac = map2.ptr<ushort>(row);
+    const TYPE scale = 1.0 / INTER_TAB_SIZE;
+
+    for (int j = j0; j < j1; ++j)
+    {
+        int x = xy[2 * j], y = xy[2 * j + 1];
+        TYPE fx = (frac[j] & (INTER_TAB_SIZE - 1)) * scale;
+        TYPE fy = (frac[j] >> INTER_BITS) * scale;
+
+        TYPE w[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+        TYPE v[4];
+        for (int k = 0; k < 4; ++k)
+        {
+            int u = x + (k & 1), t = y + (k >> 1) - srcRow;
+            bool inside = (u >= 0) & (u < src.cols) & (t >= 0) & (t < src.rows);
+            v[k] = inside ? loadPhase(src.ptr<P>(t), u) : NAN;
+        }
+
+        // Nearest tap decides validity.
+        int nearest = (fx >= 0.5) + 2 * (fy >= 0.5);
+        if (isnan(v[nearest]))
+        {
+            storePhase(dst, j, NAN);
+            continue;
+        }
+        TYPE sum = 0, weight = 0;
+        for (int k = 0; k < 4; ++k)
+            if (!isnan(v[k]))
+            {
+                sum += w[k] * v[k];
+                weight += w[k];
+            }
+        storePhase(dst, j, sum / weight);
+    }
+}
+
+template <typename P>
+void stereoProcessor::rectifyPhaseRows(const Mat &src1, int srcRow1, const Mat &src2, int srcRow2, int row, P *dst1, P *dst2)
+{
+    int cols = imgSize.width;
+    if (!mask)
+    {
+        rectifyPhaseRow(src1, srcRow1, map11, map12, row, dst1, 0, cols);
+        rectifyPhaseRow(src2, srcRow2, map21, map22, row, dst2, 0, cols);
+        return;
+    }
+
+    int spanNum = mask->spanNum(row);
+    const int *spans = mask->rowSpans(row);
+    for (int j = 0; j < cols; ++j)
+        storePhase(dst1, j, NAN);
+    for (int s = 0; s < spanNum; ++s)
+        rectifyPhaseRow(src1, srcRow1, map11, map12, row, dst1, spans[2 * s], spans[2 * s + 1]);
+    // Matches of a row may lie anywhere in the right row.
+    if (spanNum)
+        rectifyPhaseRow(src2, srcRow2, map21, map22, row, dst2, 0, cols);
+    else
+        for (int j = 0; j < cols; ++j)
+            storePhase(dst2, j, NAN);
 }
 
 void stereoProcessor::calRectifyMap()
 {
+    // Maps may point into a read-only cache mapping, drop them before recalculation.
+    map11.release();
+    map12.release();
+    map21.release();
+    map22.release();
+    cacheMapping.reset();
+
     // Stereo rectify.
     Rect validPixROI1, validPixROI2;
     stereoRectify(K1, D1, K2, D2, imgSize, R, T, R1, R2, P1, P2, Q, CALIB_ZERO_DISPARITY, 1, imgSize, &validPixROI1, &validPixROI2);
@@ -135,39 +509,500 @@ void stereoProcessor::calRectifyMap()
 
 void stereoProcessor::calDisparity(const Mat &absPhase1, const Mat &absPhase2, Mat &disparity, bool interpolation)
 {
+    PMP_CALL(instrument);
+    checkPhase(absPhase1, absPhase2);
+
     // Allocate memory for disparity map.
     disparity.create(absPhase1.size(), CV_TYPE);
-    Mat absPhase2ROI = absPhase2(ROI2);
-#pragma omp parallel for
-    for (int i = 0; i < disparity.rows; ++i)
+    int decodeCols = (absPhase1.type() == CV_16UC1) ? disparity.cols : 0;
+    // Scratch slots are reserved here, as nothing may throw in the parallel region.
+    matchBuffers::reserve(workspace, absPhase2.cols, lrCheck);
+    scratchBuffer<TYPE>::reserve(workspace, 0, decodeCols);
+    scratchBuffer<TYPE>::reserve(workspace, 1, decodeCols);
+#pragma omp parallel
+    {
+        // Match buffers, reused by all rows of this thread.
+        matchBuffers buf(workspace, absPhase2.cols, lrCheck);
+        // Decoded rows of fixed-point phase.
+        scratchBuffer<TYPE> buf1(workspace, 0, decodeCols), buf2(workspace, 1, decodeCols);
+#pragma omp for
+        for (int i = 0; i < disparity.rows; ++i)
+            matchRow(phaseRow(absPhase1, i, buf1.data()), phaseRow(absPhase2, i, buf2.data()), disparity.ptr<TYPE>(i), disparity.cols, i, interpolation, buf);
+    }
+}
+
+void stereoProcessor::calDisparityRectify(const Mat &absPhase1, const Mat &absPhase2, Mat &disparity, bool interpolation)
+{
+    // Allocate memory for disparity map.
+    disparity.create(imgSize, CV_TYPE);
+    calDisparityRows(absPhase1, 0, absPhase2, 0, 0, imgSize.height, &disparity, NULL, interpolation);
+}
+
+void stereoProcessor::calDisparityRows(const Mat &absPhase1, int srcRow1, const Mat &absPhase2, int srcRow2, int r0, int r1, Mat *disparity, pointCloud *cloud, bool interpolation)
+{
+    PMP_CALL(instrument);
+    if (map11.empty() | map21.empty())
+    {
+        cout << "Rectification map is empty!" << endl;
+        throw exception();
+    }
+    if (cloud && Q.empty())
+    {
+        cout << "Disparity-to-depth mapping matrix is empty!" << endl;
+        throw exception();
+    }
+    checkPhase(absPhase1, absPhase2);
+
+    int cols = imgSize.width;
+    bool fixed = absPhase1.type() == CV_16UC1;
+    vector<pointCloud> localCloud((cloud && !workspace) ? omp_get_max_threads() : 0);
+    matchBuffers::reserve(workspace, cols, lrCheck);
+    scratchBuffer<TYPE>::reserve(workspace, 0, cols);
+    scratchBuffer<TYPE>::reserve(workspace, 1, cols);
+    scratchBuffer<ushort>::reserve(workspace, 2, fixed ? cols : 0);
+    scratchBuffer<ushort>::reserve(workspace, 3, fixed ? cols : 0);
+    scratchBuffer<TYPE>::reserve(workspace, 4, disparity ? 0 : cols);
+#pragma omp parallel
     {
-        for (int j = 0; j < disparity.cols; ++j)
+        matchBuffers buf(workspace, cols, lrCheck);
+        // Rectified rows of both cameras. Fixed-point rows are rectified in codes as rectifyPhase does, then decoded.
+        scratchBuffer<TYPE> row1(workspace, 0, cols), row2(workspace, 1, cols);
+        scratchBuffer<ushort> fixed1(workspace, 2, fixed ? cols : 0), fixed2(workspace, 3, fixed ? cols : 0);
+        // Row buffer used when disparity map is not stored.
+        scratchBuffer<TYPE> rowBuf(workspace, 4, disparity ? 0 : cols);
+        pointCloud *local = cloud ? &threadCloud(localCloud) : NULL;
+        // Static schedule gives each thread a continuous block of rows, so clouds are merged in row order.
+#pragma omp for schedule(static)
+        for (int i = r0; i < r1; ++i)
         {
-            if (ROI1.contains(Point(j, i)))
+            // Rows out of ROI are not read by matchRow.
+            if (i >= ROI1.y && i < ROI1.y + ROI1.height)
             {
-                TYPE x = absPhase1.at<TYPE>(i, j);
-
-                TYPE matchPoint = isnan(x) ? -1 : searchPhase(x, absPhase2ROI.row(i - ROI2.y), interpolation) + ROI2.x;
-                if (matchPoint > -1)
-                    disparity.at<TYPE>(i, j) = (j - matchPoint) > disparityTH ? j - matchPoint : 0;
+                PMP_ROWS(instrument, STAGE_RECTIFY, 1);
+                if (fixed)
+                {
+                    rectifyPhaseRows(absPhase1, srcRow1, absPhase2, srcRow2, i, fixed1.data(), fixed2.data());
+                    decodePhaseRow(fixed1.data(), row1.data(), cols, phaseScale);
+                    decodePhaseRow(fixed2.data(), row2.data(), cols, phaseScale);
+                }
                 else
-                    disparity.at<TYPE>(i, j) = NAN;
+                    rectifyPhaseRows(absPhase1, srcRow1, absPhase2, srcRow2, i, row1.data(), row2.data());
+            }
+            TYPE *dst = disparity ? disparity->ptr<TYPE>(i - r0) : rowBuf.data();
+            matchRow(row1.data(), row2.data(), dst, cols, i, interpolation, buf);
+            if (local)
+                reprojectRow(dst, cols, i, Mat(), *local);
+        }
+    }
+    if (cloud)
+        mergeCloud(localCloud, *cloud);
+}
+
+void stereoProcessor::rectifySourceRows(int camera, int r0, int r1, int &s0, int &s1) const
+{
+    const Mat &map1 = (camera == 1) ? map11 : map21;
+    if (map1.empty())
+    {
+        cout << "Rectification map is empty!" << endl;
+        throw exception();
+    }
+    // Bilinear taps read rows y and y + 1.
+    int lo = INT_MAX, hi = INT_MIN;
+    for (int i = r0; i < r1; ++i)
+    {
+        const short *xy = map1.ptr<short>(i);
+        for (int j = 0; j < map1.cols; ++j)
+        {
+            lo = min(lo, (int)xy[2 * j + 1]);
+            hi = max(hi, (int)xy[2 * j + 1]);
+        }
+    }
+    s0 = max(lo, 0);
+    s1 = min(hi + 2, imgSize.height);
+}
+
+void stereoProcessor::calDisparity(const Mat &absPhase1, const Mat &absPhase2, Mat &disparity, const Mat &prior, int convention, int radius, Mat &priorFail, bool interpolation)
+{
+    PMP_CALL(instrument);
+    if (convention != SPECKLE_PRIOR && convention != DISPARITY_PRIOR)
+    {
+        cout << "Error disparity prior convention!" << endl;
+        throw exception();
+    }
+    if (prior.empty() || prior.type() != (convention == SPECKLE_PRIOR ? CV_16UC1 : CV_TYPE))
+    {
+        cout << "Disparity prior must be CV_16UC1 for SPECKLE_PRIOR and CV_TYPE for DISPARITY_PRIOR!" << endl;
+        throw exception();
+    }
+    checkPhase(absPhase1, absPhase2);
+
+    // Allocate memory for disparity map and fail mask.
+    disparity.create(absPhase1.size(), CV_TYPE);
+    priorFail.create(absPhase1.size(), CV_8U);
+    int decodeCols = (absPhase1.type() == CV_16UC1) ? disparity.cols : 0;
+    matchBuffers::reserve(workspace, absPhase2.cols, lrCheck);
+    scratchBuffer<TYPE>::reserve(workspace, 0, decodeCols);
+    scratchBuffer<TYPE>::reserve(workspace, 1, decodeCols);
+#pragma omp parallel
+    {
+        matchBuffers buf(workspace, absPhase2.cols, lrCheck);
+        scratchBuffer<TYPE> buf1(workspace, 0, decodeCols), buf2(workspace, 1, decodeCols);
+#pragma omp for
+        for (int i = 0; i < disparity.rows; ++i)
+        {
+            int priorRow = (int)((long long)i * prior.rows / disparity.rows);
+            matchRowPrior(phaseRow(absPhase1, i, buf1.data()), phaseRow(absPhase2, i, buf2.data()), disparity.ptr<TYPE>(i), priorFail.ptr<uchar>(i), disparity.cols, i, prior.row(priorRow), convention, radius, interpolation, buf);
+        }
+    }
+}
+
+void stereoProcessor::calDisparity(const Mat &absPhase1, const Mat &absPhase2, Mat &disparity, pointCloud &cloud, const Mat &intensity, bool interpolation)
+{
+    // Allocate memory for disparity map.
+    disparity.create(absPhase1.size(), CV_TYPE);
+    matchCloud(absPhase1, absPhase2, &disparity, cloud, intensity, interpolation);
+}
+
+void stereoProcessor::calPointCloud(const Mat &absPhase1, const Mat &absPhase2, pointCloud &cloud, const Mat &intensity, bool interpolation)
+{
+    matchCloud(absPhase1, absPhase2, NULL, cloud, intensity, interpolation);
+}
+
+void stereoProcessor::reproject(const Mat &disparity, pointCloud &cloud, const Mat &intensity)
+{
+    PMP_CALL(instrument);
+    if (Q.empty())
+    {
+        cout << "Disparity-to-depth mapping matrix is empty!" << endl;
+        throw exception();
+    }
+
+    vector<pointCloud> localCloud(workspace ? 0 : omp_get_max_threads());
+    if (workspace)
+        workspace->checkThreads();
+#pragma omp parallel
+    {
+        pointCloud &local = threadCloud(localCloud);
+        // Static schedule gives each thread a continuous block of rows, so clouds are merged in row order.
+#pragma omp for schedule(static)
+        for (int i = 0; i < disparity.rows; ++i)
+            reprojectRow(disparity.ptr<TYPE>(i), disparity.cols, i, intensity, local);
+    }
+    mergeCloud(localCloud, cloud);
+}
+
+void stereoProcessor::matchCloud(const Mat &absPhase1, const Mat &absPhase2, Mat *disparity, pointCloud &cloud, const Mat &intensity, bool interpolation)
+{
+    PMP_CALL(instrument);
+    if (Q.empty())
+    {
+        cout << "Disparity-to-depth mapping matrix is empty!" << endl;
+        throw exception();
+    }
+    checkPhase(absPhase1, absPhase2);
+
+    int cols = absPhase1.cols;
+    int decodeCols = (absPhase1.type() == CV_16UC1) ? cols : 0;
+    vector<pointCloud> localCloud(workspace ? 0 : omp_get_max_threads());
+    matchBuffers::reserve(workspace, absPhase2.cols, lrCheck);
+    scratchBuffer<TYPE>::reserve(workspace, 0, disparity ? 0 : cols);
+    scratchBuffer<TYPE>::reserve(workspace, 1, decodeCols);
+    scratchBuffer<TYPE>::reserve(workspace, 2, decodeCols);
+#pragma omp parallel
+    {
+        matchBuffers buf(workspace, absPhase2.cols, lrCheck);
+        // Row buffer used when disparity map is not stored.
+        scratchBuffer<TYPE> rowBuf(workspace, 0, disparity ? 0 : cols);
+        scratchBuffer<TYPE> buf1(workspace, 1, decodeCols), buf2(workspace, 2, decodeCols);
+        pointCloud &local = threadCloud(localCloud);
+#pragma omp for schedule(static)
+        for (int i = 0; i < absPhase1.rows; ++i)
+        {
+            TYPE *dst = disparity ? disparity->ptr<TYPE>(i) : rowBuf.data();
+            matchRow(phaseRow(absPhase1, i, buf1.data()), phaseRow(absPhase2, i, buf2.data()), dst, cols, i, interpolation, buf);
+            reprojectRow(dst, cols, i, intensity, local);
+        }
+    }
+    mergeCloud(localCloud, cloud);
+}
+
+void stereoProcessor::checkPhase(const Mat &absPhase1, const Mat &absPhase2) const
+{
+    if ((absPhase1.type() != CV_TYPE && absPhase1.type() != CV_16UC1) || absPhase1.type() != absPhase2.type())
+    {
+        cout << "Phase maps must be both CV_TYPE or both CV_16UC1!" << endl;
+        throw exception();
+    }
+    if (absPhase1.type() == CV_16UC1 && !(phaseScale > 0))
+    {
+        cout << "Phase scale of fixed-point phase is not set!" << endl;
+        throw exception();
+    }
+}
+
+const TYPE *stereoProcessor::phaseRow(const Mat &phase, int row, TYPE *buf) const
+{
+    if (phase.type() != CV_16UC1)
+        return phase.ptr<TYPE>(row);
+    decodePhaseRow(phase.ptr<ushort>(row), buf, phase.cols, phaseScale);
+    return buf;
+}
+
+pointCloud &stereoProcessor::threadCloud(vector<pointCloud> &localCloud)
+{
+    int t = omp_get_thread_num();
+    return workspace ? workspace->threadCloud(t) : localCloud[t];
+}
+
+void stereoProcessor::mergeCloud(vector<pointCloud> &localCloud, pointCloud &cloud)
+{
+    int threads = workspace ? workspace->threads() : localCloud.size();
+    cloud.clear();
+    for (int t = 0; t < threads; ++t)
+    {
+        pointCloud &local = workspace ? workspace->threadCloud(t) : localCloud[t];
+        cloud.append(local);
+        // Workspace clouds keep their capacity for the next frame.
+        local.clear();
+    }
+}
+
+void stereoProcessor::reprojectRow(const TYPE *disparity, int cols, int row, const Mat &intensity, pointCloud &cloud)
+{
+    // [X Y Z W]^T = Q * [j i d 1]^T.
+    const double *q0 = Q.ptr<double>(0), *q1 = Q.ptr<double>(1), *q2 = Q.ptr<double>(2), *q3 = Q.ptr<double>(3);
+    double x0 = q0[1] * row + q0[3], y0 = q1[1] * row + q1[3], z0 = q2[1] * row + q2[3], w0 = q3[1] * row + q3[3];
+    bool useIntensity = !intensity.empty();
+    bool byteIntensity = useIntensity && intensity.depth() == CV_8U;
+    PMP_ROWS(instrument, STAGE_REPROJECT, 1);
+    PMP_COUNT(instrument, COUNT_POINTS, -(long)cloud.size());
+
+    for (int j = 0; j < cols; ++j)
+    {
+        TYPE d = disparity[j];
+        // Skip pixels without match. Negative disparity is valid, e.g. of converging cameras.
+        if (isnan(d))
+            continue;
+        double w = q3[0] * j + q3[2] * d + w0;
+        if (w == 0)
+            continue;
+        cloud.x.push_back((q0[0] * j + q0[2] * d + x0) / w);
+        cloud.y.push_back((q1[0] * j + q1[2] * d + y0) / w);
+        cloud.z.push_back((q2[0] * j + q2[2] * d + z0) / w);
+        if (useIntensity)
+            cloud.intensity.push_back(byteIntensity ? intensity.ptr<uchar>(row)[j] : intensity.ptr<TYPE>(row)[j]);
+    }
+    PMP_COUNT(instrument, COUNT_POINTS, (long)cloud.size());
+}
+
+#ifdef PMP_INSTRUMENTATION
+// Count match results of a row by reason. Pixels out of mask are out of ROI.
+static void countMatchRow(pmpInstrument *ins, const TYPE *phase1, const TYPE *dst, int cols, int roiBegin, int roiEnd, const spanMask *mask, int row)
+{
+    if (!ins)
+        return;
+    long n[COUNT_NUM] = {0};
+    for (int j = 0; j < cols; ++j)
+    {
+        if (j < roiBegin || j >= roiEnd || (mask && !mask->contains(row, j)))
+            ++n[COUNT_MATCH_OUT_ROI];
+        else if (isnan(phase1[j]))
+            ++n[COUNT_MATCH_INVALID];
+        else if (isnan(dst[j]))
+            ++n[COUNT_MATCH_NO_MATCH];
+        else if (dst[j] == 0)
+            ++n[COUNT_MATCH_DISPARITY_TH];
+        else
+            ++n[COUNT_MATCH_VALID];
+    }
+    for (int c = COUNT_MATCH_OUT_ROI; c <= COUNT_MATCH_VALID; ++c)
+        ins->count(c, n[c]);
+}
+#endif
+
+stereoProcessor::matchBuffers::matchBuffers(pmpWorkspace *ws, int cols, bool lrCheck) : runs(ws ? ws->indexBuffer(0) : localRuns),
+                                                                                     leftRuns(ws ? ws->indexBuffer(1) : localLeftRuns),
+                                                                                     reverse(ws, WS_SCRATCH_SLOTS - 1, lrCheck ? 2 * cols : 0)
+{
+}
+
+void stereoProcessor::matchBuffers::reserve(pmpWorkspace *ws, int cols, bool lrCheck)
+{
+    scratchBuffer<TYPE>::reserve(ws, WS_SCRATCH_SLOTS - 1, lrCheck ? 2 * cols : 0);
+}
+
+int stereoProcessor::matchSpans(int row, const int *whole, const int *&spans) const
+{
+    if (!mask)
+    {
+        spans = whole;
+        return 1;
+    }
+    spans = mask->rowSpans(row);
+    return mask->spanNum(row);
+}
+
+void stereoProcessor::matchRow(const TYPE *phase1, const TYPE *phase2, TYPE *dst, int cols, int row, bool interpolation, matchBuffers &buf)
+{
+    PMP_ROWS(instrument, STAGE_MATCH, 1);
+    for (int j = 0; j < cols; ++j)
+        dst[j] = NAN;
+    const int *spans;
+    int whole[2] = {ROI1.x, ROI1.x + ROI1.width};
+    int spanNum = matchSpans(row, whole, spans);
+    if (row < ROI1.y || row >= ROI1.y + ROI1.height || spanNum == 0)
+    {
+        PMP_COUNT(instrument, COUNT_MATCH_OUT_ROI, cols);
+        return;
+    }
+
+    const TYPE *seq = phase2 + ROI2.x;
+    bool monotonic = (searchMode == MONOTONIC_SEARCH) && splitRuns(seq, ROI2.width, buf.runs);
+    if (lrCheck)
+        beginConsistency(phase1, seq, monotonic, interpolation, buf);
+    // Only pixels of spans inside ROI are matched.
+    for (int s = 0; s < spanNum; ++s)
+        for (int j = max(spans[2 * s], ROI1.x); j < min(spans[2 * s + 1], ROI1.x + ROI1.width); ++j)
+        {
+            TYPE x = phase1[j];
+            if (isnan(x))
+                continue;
+
+            TYPE matchPoint = monotonic ? searchPhaseRuns(x, seq, ROI2.width, buf.runs, interpolation) : searchPhase(x, seq, ROI2.width, interpolation);
+            if (matchPoint > -1)
+            {
+                matchPoint += ROI2.x;
+                dst[j] = (j - matchPoint) > disparityTH ? j - matchPoint : 0;
+                // Matches not confirmed from the right are occlusions or false matches.
+                if (lrCheck && !checkConsistency(phase1, phase2, j, matchPoint, interpolation, buf))
+                {
+                    dst[j] = NAN;
+                    // Counted apart from pixels without match.
+                    PMP_COUNT(instrument, COUNT_MATCH_LR_FAIL, 1);
+                    PMP_COUNT(instrument, COUNT_MATCH_NO_MATCH, -1);
+                }
+            }
+        }
+#ifdef PMP_INSTRUMENTATION
+    countMatchRow(instrument, phase1, dst, cols, ROI1.x, ROI1.x + ROI1.width, mask, row);
+#endif
+}
+
+void stereoProcessor::matchRowPrior(const TYPE *phase1, const TYPE *phase2, TYPE *dst, uchar *fail, int cols, int row, const Mat &priorRow, int convention, int radius, bool interpolation, matchBuffers &buf)
+{
+    PMP_ROWS(instrument, STAGE_MATCH, 1);
+    for (int j = 0; j < cols; ++j)
+    {
+        fail[j] = 0;
+        dst[j] = NAN;
+    }
+    const int *spans;
+    int whole[2] = {ROI1.x, ROI1.x + ROI1.width};
+    int spanNum = matchSpans(row, whole, spans);
+    if (row < ROI1.y || row >= ROI1.y + ROI1.height || spanNum == 0)
+    {
+        PMP_COUNT(instrument, COUNT_MATCH_OUT_ROI, cols);
+        return;
+    }
+
+    const TYPE *seq = phase2 + ROI2.x;
+    const uchar *priorPtr = priorRow.ptr<uchar>(0);
+    // Runs are built only if some pixel of this row falls back to row search, or for left-right check.
+    bool runsReady = false, monotonic = false;
+    if (lrCheck)
+    {
+        monotonic = (searchMode == MONOTONIC_SEARCH) && splitRuns(seq, ROI2.width, buf.runs);
+        runsReady = true;
+        beginConsistency(phase1, seq, monotonic, interpolation, buf);
+    }
+    // Only pixels of spans inside ROI are matched.
+    for (int s = 0; s < spanNum; ++s)
+        for (int j = max(spans[2 * s], ROI1.x); j < min(spans[2 * s + 1], ROI1.x + ROI1.width); ++j)
+        {
+            TYPE x = phase1[j];
+            if (isnan(x))
+                continue;
+
+            // Prior is per pixel or per tile. Speckle disparity points the other way and has its own missing value.
+            int priorCol = (int)((long long)j * priorRow.cols / cols);
+            TYPE d;
+            if (convention == SPECKLE_PRIOR)
+            {
+                ushort w = ((const ushort *)priorPtr)[priorCol];
+                d = (w == PRIOR_NONE) ? NAN : -(TYPE)w;
             }
             else
-                disparity.at<TYPE>(i, j) = NAN;
+                d = ((const TYPE *)priorPtr)[priorCol];
+            TYPE matchPoint = -1;
+            bool wrong = isnan(d);
+            if (!wrong)
+            {
+                int center = (int)round(j - d) - ROI2.x;
+                int lo = max(center - radius, 0), hi = min(center + radius, ROI2.width - 1);
+                bool edge = false;
+                if (lo <= hi)
+                    matchPoint = searchPhaseWindow(x, seq, ROI2.width, lo, hi, interpolation, edge);
+                wrong = !(matchPoint > -1) || edge;
+            }
+            if (wrong)
+            {
+                fail[j] = 1;
+                if (!runsReady)
+                {
+                    monotonic = (searchMode == MONOTONIC_SEARCH) && splitRuns(seq, ROI2.width, buf.runs);
+                    runsReady = true;
+                }
+                matchPoint = monotonic ? searchPhaseRuns(x, seq, ROI2.width, buf.runs, interpolation) : searchPhase(x, seq, ROI2.width, interpolation);
+            }
+
+            if (matchPoint > -1)
+            {
+                matchPoint += ROI2.x;
+                dst[j] = (j - matchPoint) > disparityTH ? j - matchPoint : 0;
+                // Matches not confirmed from the right are occlusions or false matches.
+                if (lrCheck && !checkConsistency(phase1, phase2, j, matchPoint, interpolation, buf))
+                {
+                    dst[j] = NAN;
+                    // Counted apart from pixels without match.
+                    PMP_COUNT(instrument, COUNT_MATCH_LR_FAIL, 1);
+                    PMP_COUNT(instrument, COUNT_MATCH_NO_MATCH, -1);
+                }
+            }
+        }
+#ifdef PMP_INSTRUMENTATION
+    countMatchRow(instrument, phase1, dst, cols, ROI1.x, ROI1.x + ROI1.width, mask, row);
+#endif
+}
+
+TYPE stereoProcessor::searchPhaseWindow(TYPE x, const TYPE *seq, int n, int lo, int hi, bool interpolation, bool &edge)
+{
+    TYPE delta = matchTH;
+    int j = -1;
+    for (int i = lo; i <= hi; i++)
+    {
+        TYPE tmp = abs(x - seq[i]);
+        if (tmp < delta)
+        {
+            delta = tmp;
+            j = i;
         }
     }
+    if (j < 0)
+        return -1;
+    // A nearest sample on the window border means the true match may lie outside.
+    edge = (j == lo && lo > 0) || (j == hi && hi < n - 1);
+    return subPixel(x, seq, n, j, interpolation);
 }
 
-TYPE stereoProcessor::searchPhase(TYPE x, const Mat &seq, bool interpolation)
+TYPE stereoProcessor::searchPhase(TYPE x, const TYPE *seq, int n, bool interpolation)
 {
     TYPE delta = matchTH;
     int j = 0;
-    for (int i = 0; i < seq.cols; i++)
+    for (int i = 0; i < n; i++)
     {
-        if (~isnan(seq.at<TYPE>(i)))
+        if (!isnan(seq[i]))
         {
-            TYPE tmp = abs(x - seq.at<TYPE>(i));
+            TYPE tmp = abs(x - seq[i]);
             if (tmp < delta)
             {
                 delta = tmp;
@@ -175,18 +1010,147 @@ TYPE stereoProcessor::searchPhase(TYPE x, const Mat &seq, bool interpolation)
             }
         }
     }
-    TYPE ans;
     if (delta < matchTH)
+        return subPixel(x, seq, n, j, interpolation);
+    else
+        return -1;
+}
+
+bool stereoProcessor::splitRuns(const TYPE *seq, int n, vector<int> &runs)
+{
+    // Runs are stored as [begin, end) pairs.
+    runs.clear();
+    int i = 0;
+    while (i < n)
     {
-        if (x - seq.at<TYPE>(j) > 0)
-            return (j == seq.cols - 1) ? j : interpolate(seq.at<TYPE>(j), seq.at<TYPE>(j + 1), j, j + 1, x);
-        else
-            return (j == 0) ? j : interpolate(seq.at<TYPE>(j - 1), seq.at<TYPE>(j), j - 1, j, x);
+        if (isnan(seq[i]))
+        {
+            ++i;
+            continue;
+        }
+        int begin = i++;
+        while (i < n && seq[i] > seq[i - 1])
+            ++i;
+        runs.push_back(begin);
+        runs.push_back(i);
+    }
+    // Each pixel visits every run, so a row of R runs costs O(n * (R + log n)). Over n / 16 runs this is
+    // no longer much cheaper than full search.
+    return (int)runs.size() / 2 <= n / 16 + 1;
+}
+
+TYPE stereoProcessor::searchPhaseRuns(TYPE x, const TYPE *seq, int n, const vector<int> &runs, bool interpolation)
+{
+    // Same nearest sample as searchPhase: smallest distance, first index on ties.
+    TYPE delta = matchTH;
+    int j = 0;
+    for (size_t r = 0; r < runs.size(); r += 2)
+    {
+        int begin = runs[r], end = runs[r + 1];
+        // Skip runs which can not hold a match.
+        if (x - seq[end - 1] >= delta || seq[begin] - x >= delta)
+            continue;
+
+        int p = lower_bound(seq + begin, seq + end, x) - seq;
+        // Samples around x are the only nearest candidates in an increasing run.
+        if (p > begin && x - seq[p - 1] < delta)
+        {
+            delta = x - seq[p - 1];
+            j = p - 1;
+        }
+        if (p < end && seq[p] - x < delta)
+        {
+            delta = seq[p] - x;
+            j = p;
+        }
     }
+    if (delta < matchTH)
+        return subPixel(x, seq, n, j, interpolation);
     else
         return -1;
 }
 
+void stereoProcessor::beginConsistency(const TYPE *phase1, const TYPE *seq, bool monotonic, bool interpolation, matchBuffers &buf)
+{
+    TYPE *reverse = buf.reverse.data();
+    if (!monotonic || !splitRuns(phase1 + ROI1.x, ROI1.width, buf.leftRuns))
+    {
+        // Searched on demand by checkConsistency.
+        for (int k = 0; k < ROI2.width; ++k)
+            reverse[k] = LR_UNSEARCHED;
+        return;
+    }
+
+    // Nearest left sample of each right sample. Both rows are increasing in runs, so each pair of overlapping runs
+    // is merged in one pass. Runs and samples are visited in index order, so ties keep the sample searchPhase keeps.
+    const TYPE *seq1 = phase1 + ROI1.x;
+    TYPE *delta = reverse + ROI2.width;
+    for (int k = 0; k < ROI2.width; ++k)
+    {
+        reverse[k] = -1;
+        delta[k] = matchTH;
+    }
+    const vector<int> &runs1 = buf.leftRuns, &runs2 = buf.runs;
+    for (size_t a = 0; a < runs1.size(); a += 2)
+    {
+        int lb = runs1[a], le = runs1[a + 1];
+        TYPE first = seq1[lb], last = seq1[le - 1];
+        for (size_t b = 0; b < runs2.size(); b += 2)
+        {
+            int rb = runs2[b], re = runs2[b + 1];
+            // Skip runs which can not hold a match, by distance as searchPhaseRuns.
+            if (first - seq[re - 1] >= matchTH || seq[rb] - last >= matchTH)
+                continue;
+            int k = lower_bound(seq + rb, seq + re, first, [this](TYPE v, TYPE f) { return f - v >= matchTH; }) - seq;
+            int p = lb;
+            for (; k < re && seq[k] - last < matchTH; ++k)
+            {
+                TYPE x = seq[k];
+                while (p < le && seq1[p] < x)
+                    ++p;
+                if (p > lb && x - seq1[p - 1] < delta[k])
+                {
+                    delta[k] = x - seq1[p - 1];
+                    reverse[k] = p - 1;
+                }
+                if (p < le && seq1[p] - x < delta[k])
+                {
+                    delta[k] = seq1[p] - x;
+                    reverse[k] = p;
+                }
+            }
+        }
+    }
+    for (int k = 0; k < ROI2.width; ++k)
+        reverse[k] = (reverse[k] > -1) ? ROI1.x + subPixel(seq[k], seq1, ROI1.width, (int)reverse[k], interpolation) : NAN;
+}
+
+bool stereoProcessor::checkConsistency(const TYPE *phase1, const TYPE *phase2, int j, TYPE matchPoint, bool interpolation, matchBuffers &buf)
+{
+    int k = min((int)(matchPoint + (TYPE)FLOOR_PRECISION), ROI2.x + ROI2.width - 1);
+    TYPE &reverse = buf.reverse[k - ROI2.x];
+    if (reverse == LR_UNSEARCHED)
+    {
+        // Search the whole left row, so that a left outlier does not find itself as the nearest sample around j.
+        TYPE r = isnan(phase2[k]) ? -1 : searchPhase(phase2[k], phase1 + ROI1.x, ROI1.width, interpolation);
+        reverse = (r > -1) ? ROI1.x + r : NAN;
+    }
+
+    // Left disparity of j against right disparity of k, both sub-pixel. No reverse match fails.
+    return abs((j - matchPoint) - (reverse - k)) <= lrTH;
+}
+
+TYPE stereoProcessor::subPixel(TYPE x, const TYPE *seq, int n, int j, bool interpolation)
+{
+    if (!interpolation)
+        return j;
+    // Equal neighbours, e.g. of fixed-point phase, can not be interpolated.
+    if (x - seq[j] > 0)
+        return (j == n - 1 || !(seq[j + 1] != seq[j])) ? j : interpolate(seq[j], seq[j + 1], j, j + 1, x);
+    else
+        return (j == 0 || !(seq[j - 1] != seq[j])) ? j : interpolate(seq[j - 1], seq[j], j - 1, j, x);
+}
+
 TYPE stereoProcessor::interpolate(TYPE x0, TYPE x1, TYPE y0, TYPE y1, TYPE x)
 {
     if (x0 == x1)
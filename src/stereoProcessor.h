@@ -2,14 +2,24 @@
 #define STEREO_PROCESSOR
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
 #include <fstream>
 #include "setting.h"
+#include "pointCloud.h"
+#include "workspace.h"
+#include "instrument.h"
+#include "phaseFixed.h"
+#include "spanMask.h"
 
 // Struct to initialize stereo calculator.
 struct stereoConfig
 {
     // File path that calibration result stored.
     std::string filePath;
+    // Binary cache file of rectification maps. Empty to disable.
+    std::string cachePath;
     // Image Size.
     cv::Size imgSize;
 
@@ -17,12 +27,22 @@ struct stereoConfig
     TYPE disparityTH;
     // Phase match threshold.
     TYPE matchTH;
+    // Codes per radian of CV_16UC1 fixed-point phase maps, phaseCalculator::getFixedScale(). 0 if not used.
+    TYPE phaseScale;
+    // Phase search algorithm.
+    // 0 for full search. Scan the whole right row for every left pixel.
+    // 1 for monotonic search. Binary search in increasing runs of right row, O(W * (R + log W)) per row of R runs.
+    // Rows of over W / 16 runs fall back to full search, so the worst case is O(W^2 / 16), a constant factor below full search.
+    int searchMode;
+    // Left-right consistency check. Matches whose right pixel does not match back within lrTH pixels are invalid.
+    bool lrCheck;
+    TYPE lrTH;
 
     // Search area. They must have same size.
     cv::Rect ROI1;
     cv::Rect ROI2;
 
-    stereoConfig(cv::Size img_size, TYPE disparity_th, TYPE match_th, std::string file_path = "");
+    stereoConfig(cv::Size img_size, TYPE disparity_th, TYPE match_th, std::string file_path = "", int search_mode = MONOTONIC_SEARCH);
 };
 
 class stereoProcessor
@@ -42,6 +62,13 @@ protected:
     int disparityTH;
     // Phase match threshold. When left phase - right phase < matchTH, regarded as a match.
     TYPE matchTH;
+    // Codes per radian of fixed-point phase maps.
+    TYPE phaseScale;
+    // Phase search algorithm.
+    int searchMode;
+    // Left-right consistency check and its threshold in pixels.
+    bool lrCheck;
+    TYPE lrTH;
     // Search area. Match points from camera1 [p1[0], p1[1]) and camera2 [p2[0], p2[1]).
     cv::Point p1[2];
     cv::Point p2[2];
@@ -49,11 +76,81 @@ protected:
     cv::Rect ROI1;
     cv::Rect ROI2;
 
+    // Binary cache file of rectification maps.
+    std::string cachePath;
+    // Memory mapping of loaded cache. Rectification maps point into it.
+    std::shared_ptr<void> cacheMapping;
+    // Workspace of temporaries. NULL to allocate them per call.
+    pmpWorkspace *workspace;
+    // Stage timers and counters. NULL to disable.
+    pmpInstrument *instrument;
+    // Valid pixels of camera 1 in rectified coordinates. NULL to process the whole ROI.
+    const spanMask *mask;
+
     // Update config.
     void updateConfig(const stereoConfig &cfg);
 
+    // Check that phase maps are both CV_TYPE or both fixed-point.
+    void checkPhase(const cv::Mat &absPhase1, const cv::Mat &absPhase2) const;
+    // Row of phase map as TYPE. Fixed-point rows are decoded into buf.
+    const TYPE *phaseRow(const cv::Mat &phase, int row, TYPE *buf) const;
+    // Point cloud of calling thread, from workspace or localCloud.
+    pointCloud &threadCloud(std::vector<pointCloud> &localCloud);
+    // Merge point clouds of threads in thread order.
+    void mergeCloud(std::vector<pointCloud> &localCloud, pointCloud &cloud);
+    // Hash of calibration parameters and image size, the key of rectification cache.
+    uint64_t caliHash() const;
+    // Map rectification cache. Return false if the file is missing, of another version or of another key.
+    bool loadRectifyCache(const std::string &path, uint64_t key);
+    // Save rectification maps, Q and ROIs to cache.
+    void saveRectifyCache(const std::string &path, uint64_t key) const;
+    // Per-thread buffers of row matching, from workspace or the heap.
+    struct matchBuffers
+    {
+        std::vector<int> localRuns, localLeftRuns;
+        // Increasing runs of right row for monotonic search, and of left row for left-right check.
+        std::vector<int> &runs, &leftRuns;
+        // Left match of each right pixel of the row for left-right check, followed by its phase distance.
+        scratchBuffer<TYPE> reverse;
+        matchBuffers(pmpWorkspace *ws, int cols, bool lrCheck);
+        // Reserve workspace scratch of matchBuffers before a parallel region.
+        static void reserve(pmpWorkspace *ws, int cols, bool lrCheck);
+    };
+
+    // Spans of a row to match, clipped to ROI1 by the caller. whole holds ROI1 columns, used without mask.
+    int matchSpans(int row, const int *whole, const int *&spans) const;
+    // Match one row of left phase map to right phase map.
+    void matchRow(const TYPE *phase1, const TYPE *phase2, TYPE *dst, int cols, int row, bool interpolation, matchBuffers &buf);
+    // Match one row with the prior row covering it. Pixels with missing or wrong prior fall back to row search and are marked in fail.
+    void matchRowPrior(const TYPE *phase1, const TYPE *phase2, TYPE *dst, uchar *fail, int cols, int row, const cv::Mat &priorRow, int convention, int radius, bool interpolation, matchBuffers &buf);
+    // Search corresponding point in seq[lo, hi]. edge is set if the nearest sample is on a window border inside the row.
+    TYPE searchPhaseWindow(TYPE x, const TYPE *seq, int n, int lo, int hi, bool interpolation, bool &edge);
     // Search corresponding point.
-    TYPE searchPhase(TYPE x, const cv::Mat &seq, bool interpolation = true);
+    TYPE searchPhase(TYPE x, const TYPE *seq, int n, bool interpolation = true);
+    // Split seq into strictly increasing runs of valid phase. Return false if seq has over n / 16 runs.
+    bool splitRuns(const TYPE *seq, int n, std::vector<int> &runs);
+    // Search corresponding point in increasing runs.
+    TYPE searchPhaseRuns(TYPE x, const TYPE *seq, int n, const std::vector<int> &runs, bool interpolation = true);
+    // Rectify one row of phase map. Bilinear over valid taps, invalid if the nearest tap is invalid or outside.
+    // Row t of src holds image row srcRow + t. P is TYPE, or ushort for fixed-point phase which is interpolated in codes.
+    // Only columns [j0, j1) of dst are written.
+    template <typename P>
+    void rectifyPhaseRow(const cv::Mat &src, int srcRow, const cv::Mat &map1, const cv::Mat &map2, int row, P *dst, int j0, int j1);
+    // Rectify one row of both cameras. Camera 1 is rectified over mask spans, camera 2 only in rows holding spans.
+    template <typename P>
+    void rectifyPhaseRows(const cv::Mat &src1, int srcRow1, const cv::Mat &src2, int srcRow2, int row, P *dst1, P *dst2);
+    // Match rows and reproject valid points. disparity is not stored if it is null.
+    void matchCloud(const cv::Mat &absPhase1, const cv::Mat &absPhase2, cv::Mat *disparity, pointCloud &cloud, const cv::Mat &intensity, bool interpolation);
+    // Reproject one disparity row with Q and append valid points to cloud.
+    void reprojectRow(const TYPE *disparity, int cols, int row, const cv::Mat &intensity, pointCloud &cloud);
+    // Left matches of the right row seq for left-right check. With monotonic right runs in buf, they are built in one sweep
+    // over increasing runs of both rows, otherwise they are searched on demand by checkConsistency.
+    void beginConsistency(const TYPE *phase1, const TYPE *seq, bool monotonic, bool interpolation, matchBuffers &buf);
+    // Check that the right pixel nearest to matchPoint matches back to left pixel j.
+    // The left match of a right pixel is the nearest sample of the whole left row, independent of j.
+    bool checkConsistency(const TYPE *phase1, const TYPE *phase2, int j, TYPE matchPoint, bool interpolation, matchBuffers &buf);
+    // Sub-pixel position of x around the nearest sample seq[j].
+    TYPE subPixel(TYPE x, const TYPE *seq, int n, int j, bool interpolation);
     //
     TYPE interpolate(TYPE x0, TYPE x1, TYPE y0, TYPE y1, TYPE x);
 
@@ -74,14 +171,51 @@ public:
     stereoProcessor(const stereoConfig &cfg);
     // Destructor.
     ~stereoProcessor();
+    // Draw temporaries from ws. NULL to allocate them per call.
+    void setWorkspace(pmpWorkspace *ws);
+    // Workspace set by setWorkspace, NULL if none.
+    pmpWorkspace *getWorkspace() const;
+    // Record stage timers and counters to ins. NULL to disable.
+    void setInstrument(pmpInstrument *ins);
+    // Instrument set by setInstrument, NULL if none.
+    pmpInstrument *getInstrument() const;
+    // Process only pixels of camera 1 in mask, of imgSize in rectified coordinates. NULL to process the whole ROI.
+    // The mask is not copied and must live while it is set.
+    void setMask(const spanMask *m);
+    // Map a mask of unrectified camera 1 image, e.g. from phaseCalculator::calMask, to rectified coordinates.
+    void rectifyMask(const spanMask &cameraMask, spanMask &rectMask) const;
     // Calculate rectify map.
     void calRectifyMap();
     // Load calibration result saved in xml file.
     void loadCaliResult(std::string filePath);
-    // Remap to get rectified image.
+    // Remap to get rectified image. With a mask, only its bounding box is remapped and pixels out of mask are 0.
     void rectifyRemap(const cv::Mat &src1, const cv::Mat &src2, cv::Mat &dst1, cv::Mat &dst2);
+    // Phase maps of the methods below are CV_TYPE, or CV_16UC1 fixed-point with stereoConfig::phaseScale set.
+    // Fixed-point rows are decoded on the fly, so maps move half of the bytes between stages.
+    // Remap absolute phase maps. NaN is kept as invalid instead of being blended into neighbours.
+    // Rectified maps are of the input type.
+    void rectifyPhase(const cv::Mat &absPhase1, const cv::Mat &absPhase2, cv::Mat &dst1, cv::Mat &dst2);
     // Match phase map and calculate disparity.
     void calDisparity(const cv::Mat &absPhase1, const cv::Mat &absPhase2, cv::Mat &disparity, bool interpolation = true);
+    // Match phase map, calculate disparity and reproject valid points in one pass.
+    // intensity is optional, CV_8U or CV_TYPE in rectified coordinates, e.g. texture or modulation.
+    void calDisparity(const cv::Mat &absPhase1, const cv::Mat &absPhase2, cv::Mat &disparity, pointCloud &cloud, const cv::Mat &intensity = cv::Mat(), bool interpolation = true);
+    // Match phase map and reproject valid points without storing disparity map.
+    void calPointCloud(const cv::Mat &absPhase1, const cv::Mat &absPhase2, pointCloud &cloud, const cv::Mat &intensity = cv::Mat(), bool interpolation = true);
+    // Match phase map with a disparity prior, scanning only prior +- radius. prior is per pixel, or per tile when smaller than phase map.
+    // convention is SPECKLE_PRIOR for CV_16U output of speckle::match, passed as is, or DISPARITY_PRIOR for CV_TYPE
+    // disparity of calDisparity, e.g. of a previous frame. Negate a speckle disparity converted to CV_TYPE.
+    // priorFail is CV_8U, 1 where the prior is missing or wrong. Those pixels are matched by full row search.
+    void calDisparity(const cv::Mat &absPhase1, const cv::Mat &absPhase2, cv::Mat &disparity, const cv::Mat &prior, int convention, int radius, cv::Mat &priorFail, bool interpolation = true);
+    // Match unrectified phase maps. Rows are rectified on the fly, so rectified phase maps are never stored.
+    void calDisparityRectify(const cv::Mat &absPhase1, const cv::Mat &absPhase2, cv::Mat &disparity, bool interpolation = true);
+    // Rectify and match rectified rows [r0, r1) from bands of unrectified phase. Row t of absPhase1 holds image row srcRow1 + t.
+    // Row t of disparity holds rectified row r0 + t. disparity is not stored and points are not reprojected if null.
+    void calDisparityRows(const cv::Mat &absPhase1, int srcRow1, const cv::Mat &absPhase2, int srcRow2, int r0, int r1, cv::Mat *disparity, pointCloud *cloud, bool interpolation = true);
+    // Rows [s0, s1) of unrectified image of camera 1 or 2 read when rectifying rows [r0, r1).
+    void rectifySourceRows(int camera, int r0, int r1, int &s0, int &s1) const;
+    // Reproject disparity map to valid points with Q.
+    void reproject(const cv::Mat &disparity, pointCloud &cloud, const cv::Mat &intensity = cv::Mat());
 };
 
 #endif
\ No newline at end of file
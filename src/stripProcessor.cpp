@@ -0,0 +1,84 @@
+#include "stripProcessor.h"
+
+using namespace std;
+using namespace cv;
+
+stripProcessor::stripProcessor(phaseCalculator &phase_cal, stereoProcessor &stereo_pro, int band_rows, bool filter) : phaseCal(phase_cal),
+                                                                                                                       stereoPro(stereo_pro),
+                                                                                                                       bandRows(band_rows),
+                                                                                                                       filter(filter)
+{
+    if (bandRows < 1)
+    {
+        cout << "Band rows can not less than 1!" << endl;
+        throw exception();
+    }
+}
+
+void stripProcessor::calDisparity(const vector<Mat> &stripImg1, const vector<Mat> &stripImg2, Mat &disparity, bool interpolation)
+{
+    disparity.create(stereoPro.imgSize, CV_TYPE);
+    process(stripImg1, stripImg2, &disparity, NULL, interpolation);
+}
+
+void stripProcessor::calPointCloud(const vector<Mat> &stripImg1, const vector<Mat> &stripImg2, pointCloud &cloud, bool interpolation)
+{
+    process(stripImg1, stripImg2, NULL, &cloud, interpolation);
+}
+
+void stripProcessor::calBandPhase(const vector<Mat> &stripImg, vector<Mat> &bandImg, Mat &phaseBuf, int s0, int s1, Mat &band, int &bandRow)
+{
+    int rows = stripImg[0].rows;
+    // Band without valid source rows still needs a phase row for type checks. Rectification reads nothing from it.
+    if (s1 <= s0)
+    {
+        s0 = 0;
+        s1 = 1;
+    }
+    // Phase filter of rows [s0, s1) reads halo rows. Halo rows themselves are not exact and never read.
+    int halo = filter ? phaseCal.getFilterHalo() : 0;
+    int c0 = max(s0 - halo, 0), c1 = min(s1 + halo, rows);
+
+    bandImg.resize(stripImg.size());
+    for (size_t k = 0; k < stripImg.size(); ++k)
+        bandImg[k] = stripImg[k].rowRange(c0, c1);
+
+    // Phase is written into a header over phaseBuf, so calAbsPhaseDirect does not allocate.
+    int type = phaseCal.getPhaseType();
+    size_t bytes = (size_t)(c1 - c0) * stripImg[0].cols * CV_ELEM_SIZE(type);
+    if (phaseBuf.total() < bytes)
+        phaseBuf.create(1, (int)bytes, CV_8UC1);
+    band = Mat(c1 - c0, stripImg[0].cols, type, phaseBuf.data);
+    phaseCal.calAbsPhaseDirect(bandImg, band, filter);
+    bandRow = c0;
+}
+
+void stripProcessor::process(const vector<Mat> &stripImg1, const vector<Mat> &stripImg2, Mat *disparity, pointCloud *cloud, bool interpolation)
+{
+    if (stripImg1.empty() || stripImg2.empty() || stripImg1[0].size() != stereoPro.imgSize || stripImg2[0].size() != stereoPro.imgSize)
+    {
+        cout << "Strip image size must equal image size of stereo processor!" << endl;
+        throw exception();
+    }
+
+    if (cloud)
+        cloud->clear();
+    int rows = stereoPro.imgSize.height;
+    for (int r0 = 0; r0 < rows; r0 += bandRows)
+    {
+        int r1 = min(r0 + bandRows, rows);
+        int s0, s1, row1, row2;
+        Mat band1, band2;
+        stereoPro.rectifySourceRows(1, r0, r1, s0, s1);
+        calBandPhase(stripImg1, bandImg1, phaseBuf1, s0, s1, band1, row1);
+        stereoPro.rectifySourceRows(2, r0, r1, s0, s1);
+        calBandPhase(stripImg2, bandImg2, phaseBuf2, s0, s1, band2, row2);
+
+        Mat dispBand;
+        if (disparity)
+            dispBand = disparity->rowRange(r0, r1);
+        stereoPro.calDisparityRows(band1, row1, band2, row2, r0, r1, disparity ? &dispBand : NULL, cloud ? &bandCloud : NULL, interpolation);
+        if (cloud)
+            cloud->append(bandCloud);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef STRIP_PROCESSOR
+#define STRIP_PROCESSOR
+
+#include <vector>
+#include "phaseCalculator.h"
+#include "stereoProcessor.h"
+
+// End-to-end processing in horizontal bands of rectified rows, from strip images to disparity and points.
+// Each band calculates absolute phase of the unrectified rows its rectification reads, plus phase filter halo,
+// then rectifies, matches and reprojects. Peak memory is proportional to band height instead of frame height.
+class stripProcessor
+{
+protected:
+    phaseCalculator &phaseCal;
+    stereoProcessor &stereoPro;
+    // Rectified rows per band.
+    int bandRows;
+    // Phase filter of absolute phase.
+    bool filter;
+
+    // Strip image views and absolute phase of current band. Phase buffers only grow.
+    std::vector<cv::Mat> bandImg1, bandImg2;
+    cv::Mat phaseBuf1, phaseBuf2; // Byte buffers holding phase bands.
+    pointCloud bandCloud;
+
+    // Calculate absolute phase of unrectified rows [s0, s1) with filter halo. Row t of band holds image row bandRow + t.
+    void calBandPhase(const std::vector<cv::Mat> &stripImg, std::vector<cv::Mat> &bandImg, cv::Mat &phaseBuf, int s0, int s1, cv::Mat &band, int &bandRow);
+    void process(const std::vector<cv::Mat> &stripImg1, const std::vector<cv::Mat> &stripImg2, cv::Mat *disparity, pointCloud *cloud, bool interpolation);
+
+public:
+    // Constructor. Objects are used by the strip processor and must be configured before processing.
+    stripProcessor(phaseCalculator &phase_cal, stereoProcessor &stereo_pro, int band_rows = 64, bool filter = true);
+
+    // Calculate rectified disparity map band by band. Strip images are all frequencies in order, one N-step set each.
+    void calDisparity(const std::vector<cv::Mat> &stripImg1, const std::vector<cv::Mat> &stripImg2, cv::Mat &disparity, bool interpolation = true);
+    // Calculate valid points band by band without any full frame map.
+    void calPointCloud(const std::vector<cv::Mat> &stripImg1, const std::vector<cv::Mat> &stripImg2, pointCloud &cloud, bool interpolation = true);
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "workspace.h"
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+using namespace std;
+using namespace cv;
+
+pmpWorkspace::pmpWorkspace(Size img_size, bool lock_memory) : imgSize(img_size),
+                                                              lockMemory(lock_memory),
+                                                              allocCount(0)
+{
+    int threads = omp_get_max_threads();
+    frameBlocks.resize(WS_BUFFER_NUM);
+    threadBlocks.assign(threads, vector<block>(WS_SCRATCH_SLOTS));
+    threadIndex.assign(threads, vector<vector<int>>(WS_SCRATCH_SLOTS));
+    threadClouds.resize(threads);
+
+    // Phase, rectification and disparity maps.
+    for (int id = 0; id <= WS_DISPARITY; ++id)
+        reserve(frameBlocks[id], (size_t)imgSize.area() * CV_ELEM_SIZE(CV_TYPE));
+    // Index buffers 0 and 1 hold the runs of right and left rows in monotonic search.
+    for (int t = 0; t < threads; ++t)
+        for (int k = 0; k < 2; ++k)
+            threadIndex[t][k].reserve(2 * (imgSize.width / 16 + 2));
+}
+
+pmpWorkspace::~pmpWorkspace()
+{
+}
+
+void pmpWorkspace::reserve(block &b, size_t bytes)
+{
+    if (bytes <= b.bytes)
+        return;
+    bytes = (bytes + WS_ALIGN - 1) / WS_ALIGN * WS_ALIGN;
+    void *data = NULL;
+    if (posix_memalign(&data, WS_ALIGN, bytes) != 0)
+    {
+        cout << "Can't allocate workspace memory!" << endl;
+        throw exception();
+    }
+    // Touch every page now instead of in the frame loop.
+    memset(data, 0, bytes);
+    bool locked = lockMemory && mlock(data, bytes) == 0;
+    if (lockMemory && !locked)
+        cout << "Can't lock workspace memory!" << endl;
+    b.data.reset((uchar *)data, [bytes, locked](uchar *p) {
+        if (locked)
+            munlock(p, bytes);
+        free(p);
+    });
+    b.bytes = bytes;
+    ++allocCount;
+}
+
+int pmpWorkspace::threadNum() const
+{
+    return omp_get_thread_num();
+}
+
+void pmpWorkspace::checkThreads() const
+{
+    if (omp_get_max_threads() > (int)threadBlocks.size())
+    {
+        cout << "Workspace has less threads than OpenMP!" << endl;
+        throw exception();
+    }
+}
+
+Size pmpWorkspace::size() const
+{
+    return imgSize;
+}
+
+Mat pmpWorkspace::frame(int id, Size size, int type)
+{
+    if (id < 0 || id >= WS_BUFFER_NUM)
+    {
+        cout << "Error workspace buffer!" << endl;
+        throw exception();
+    }
+    block &b = frameBlocks[id];
+    size_t bytes = (size_t)size.area() * CV_ELEM_SIZE(type);
+    // Growing would free memory still referenced by returned headers.
+    if (b.used && bytes > b.bytes)
+    {
+        cout << "Workspace frame buffer can't grow after use!" << endl;
+        throw exception();
+    }
+    reserve(b, bytes);
+    b.used = true;
+    return Mat(size, type, b.data.get());
+}
+
+Mat pmpWorkspace::frame(int id)
+{
+    return frame(id, imgSize, CV_TYPE);
+}
+
+void pmpWorkspace::reserveScratch(int slot, size_t bytes)
+{
+    checkThreads();
+    for (size_t t = 0; t < threadBlocks.size(); ++t)
+        reserve(threadBlocks[t][slot], bytes);
+}
+
+void *pmpWorkspace::scratch(int slot)
+{
+    return threadBlocks[threadNum()][slot].data.get();
+}
+
+vector<int> &pmpWorkspace::indexBuffer(int slot)
+{
+    return threadIndex[threadNum()][slot];
+}
+
+pointCloud &pmpWorkspace::threadCloud(int t)
+{
+    return threadClouds[t];
+}
+
+int pmpWorkspace::threads() const
+{
+    return threadBlocks.size();
+}
+
+size_t pmpWorkspace::allocations() const
+{
+    return allocCount;
+}
@@ -0,0 +1,113 @@
+#ifndef PMP_WORKSPACE
+#define PMP_WORKSPACE
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include "setting.h"
+#include "pointCloud.h"
+
+// Frame buffers of workspace. Buffers up to WS_DISPARITY are image size CV_TYPE maps reserved at construction.
+#define WS_REL_PHASE1 0
+#define WS_REL_PHASE2 1
+#define WS_REL_PHASE3 2
+#define WS_ABS_PHASE1 3
+#define WS_ABS_PHASE2 4
+#define WS_RECT_PHASE1 5
+#define WS_RECT_PHASE2 6
+#define WS_DISPARITY 7
+// Internal frame buffers of stages.
+#define WS_SPECKLE_SUM 8
+#define WS_BUFFER_NUM 9
+// Scratch slots and index buffers per thread.
+#define WS_SCRATCH_SLOTS 8
+// Alignment of workspace buffers in bytes.
+#define WS_ALIGN 64
+
+// Arena of aligned, pre-faulted and optionally locked buffers reused across frames.
+// Frame buffers hold per-frame maps, scratch buffers hold per-thread temporaries of a stage.
+// Buffers only grow, so once every stage has run for one frame no more heap allocation happens.
+// Stages sharing a workspace must run one after another: slots are per OpenMP thread number, and thread 0 of
+// teams started by different threads, e.g. stages of stereoPipeline, would share one. Create it after setting OpenMP thread number.
+class pmpWorkspace
+{
+protected:
+    struct block
+    {
+        std::shared_ptr<uchar> data;
+        size_t bytes;
+        // Headers of a frame buffer were returned, so its memory can't be replaced.
+        bool used;
+        block() : bytes(0), used(false) {}
+    };
+
+    cv::Size imgSize;
+    // Lock buffers in RAM.
+    bool lockMemory;
+    std::vector<block> frameBlocks;
+    // Scratch blocks and index buffers of each thread.
+    std::vector<std::vector<block>> threadBlocks;
+    std::vector<std::vector<std::vector<int>>> threadIndex;
+    std::vector<pointCloud> threadClouds;
+    std::atomic<size_t> allocCount;
+
+    // Grow block to at least bytes.
+    void reserve(block &b, size_t bytes);
+    // Thread number of caller. Entry points check it with checkThreads before parallel regions.
+    int threadNum() const;
+
+public:
+    // Constructor. Frame buffers of img_size are allocated and pre-faulted here.
+    pmpWorkspace(cv::Size img_size, bool lock_memory = false);
+    ~pmpWorkspace();
+
+    cv::Size size() const;
+    // Frame buffer of id. Same id returns the same memory. Headers do not own it, so a buffer can't grow once returned.
+    // Call outside parallel regions.
+    cv::Mat frame(int id, cv::Size size, int type);
+    cv::Mat frame(int id);
+    // Throw if OpenMP may start more threads than workspace has. Call outside parallel regions.
+    void checkThreads() const;
+    // Grow scratch slot of every thread to bytes, after checkThreads. Call outside parallel regions.
+    void reserveScratch(int slot, size_t bytes);
+    // Scratch buffer of calling thread, reserved by reserveScratch. Content is not kept between stages.
+    void *scratch(int slot);
+    // Index buffer of calling thread. Capacity is kept between calls.
+    std::vector<int> &indexBuffer(int slot);
+    // Point cloud of thread t.
+    pointCloud &threadCloud(int t);
+    int threads() const;
+    // Number of buffer allocations made so far. Constant in steady state.
+    size_t allocations() const;
+};
+
+// Scratch buffer drawn from a workspace, or from the heap if there is none.
+// Slots of a workspace are reserved with reserve before the parallel region, so construction does not throw in it.
+template <class T>
+class scratchBuffer
+{
+protected:
+    std::vector<T> local;
+    T *ptr;
+
+public:
+    scratchBuffer(pmpWorkspace *ws, int slot, size_t n)
+    {
+        if (ws)
+            ptr = (T *)ws->scratch(slot);
+        else
+        {
+            local.resize(n);
+            ptr = local.data();
+        }
+    }
+    T *data() { return ptr; }
+    static void reserve(pmpWorkspace *ws, int slot, size_t n)
+    {
+        if (ws)
+            ws->reserveScratch(slot, n * sizeof(T));
+    }
+    T &operator[](size_t i) { return ptr[i]; }
+};
+
+#endif